@@ -10,6 +10,11 @@
 #ifndef PKA_AMALGAMATED_H
 #define PKA_AMALGAMATED_H
 
+/* Both libraries are optional, define PKA_WITH_MMDB and PKA_WITH_OCCT
+ * to build with them. Without them only the PKD core is left, which
+ * reads PDB and mmCIF files with PKD::CarbonAlphaReader.
+ */
+
 // c++17
 #include <string>
 #include <iostream>
@@ -29,9 +34,11 @@
  * License: GNU LGPL v3
  * Documentation: https://www.ebi.ac.uk/pdbe/docs/cldoc/object/cl_object.html
  */
+#ifdef PKA_WITH_MMDB
 #include <mmdb_manager.h>
 // MMDB conficts with OCCT so we must rename the definition
 #define Abs Absx
+#endif
 
 /* openCascade (OCCT) 7.4.0
  * OCCT library is designed to be truly modular and extensible, providing C++ classes for:
@@ -41,6 +48,7 @@
  * -Working with mesh (faceted) data;
  * -Data interoperability with neutral formats (IGES, STEP);
  */
+#ifdef PKA_WITH_OCCT
 #include <STEPControl_Writer.hxx>
 #include <TopoDS_Shape.hxx>
 #include <BRepTools.hxx>
@@ -49,12 +57,14 @@
 #include <TopoDS_Edge.hxx>
 #include <BRepBuilderAPI_MakeEdge.hxx>
 #include <XCAFDoc_ColorTool.hxx>
+#endif
 
 /*
  * PKA = Protein Knot Analyzer
  */
 namespace PKA {
 
+#ifdef PKA_WITH_MMDB
 /*
  * Mediates extraction of data between the MMDB Manager and the Alpha Carbon Matrix.
  * The MMDB Manager handles PDB, CIF, and MMDBF file formats.
@@ -74,7 +84,9 @@ public:
 	std::unique_ptr<PKD::DoubleMatrix> toMatrix();
 	std::unique_ptr<CMMDBManager> toMMDB();
 };
+#endif
 
+#ifdef PKA_WITH_OCCT
 /*
  * Holds a openCascade (OCCT) shape and performs data exchange
  * Internal data is public since this is suppose to be
@@ -101,7 +113,9 @@ public:
 	std::unique_ptr<PKD::DoubleMatrix> getMatrix();
 	void toShape();
 };
+#endif
 
+#ifdef PKA_WITH_MMDB
 void MMDBAndCarbonAlphaMatrix::setMMDBModel(
 		std::unique_ptr<CMMDBManager> MMDBPtr, int modelId, cpstr chainId) {
 	ModelPtr_ = std::move(MMDBPtr);
@@ -269,7 +283,9 @@ std::unique_ptr<CMMDBManager> MMDBAndCarbonAlphaMatrix::toMMDB() {
 	}
 	return std::move(MMDB);
 }
+#endif
 
+#ifdef PKA_WITH_OCCT
 int OCCT_Shape::writeSTEP(char* path) {
 	STEPControl_Writer writer;
 	if (!Interface_Static::SetIVal("write.precision.mode", 1)) {
@@ -304,25 +320,26 @@ std::unique_ptr<PKD::DoubleMatrix> CarbonAlphaMatrixAndOCCT_Shape::getMatrix() {
 }
 void CarbonAlphaMatrixAndOCCT_Shape::toShape() {
 	shapePtr_ = std::make_unique<OCCT_Shape>();
-	std::unique_ptr<gp_Pnt> pntCurrentPtr, pntLastPtr;
+	// points are plain values, nothing is allocated per point
+	gp_Pnt pntCurrent, pntLast;
 	// Start building the compound
 	std::unique_ptr<TopoDS_Compound> shape = std::make_unique<TopoDS_Compound>();
 	BRep_Builder aBuilder;
 	aBuilder.MakeCompound(*shape);
 	// Fill compound with lines
 	for (size_t i = 0; i < matrixPtr_->n; i += 3) {
-		pntCurrentPtr = std::make_unique<gp_Pnt>(matrixPtr_->m[i],
-				matrixPtr_->m[i + 1], matrixPtr_->m[i + 2]);
-		if (pntLastPtr) {
-			TopoDS_Edge edge = BRepBuilderAPI_MakeEdge(*pntCurrentPtr,
-					*pntLastPtr);
+		pntCurrent.SetCoord(matrixPtr_->m[i], matrixPtr_->m[i + 1],
+				matrixPtr_->m[i + 2]);
+		if (i > 0) {
+			TopoDS_Edge edge = BRepBuilderAPI_MakeEdge(pntCurrent, pntLast);
 			aBuilder.Add(*shape, edge);
 		}
-		pntLastPtr = std::move(pntCurrentPtr);
+		pntLast = pntCurrent;
 	}
 	// Done building
 	shapePtr_->shape_ = std::move(shape);
 }
+#endif
 
 } // namespace PKA
 
@@ -19,10 +19,37 @@
 #include <iostream>
 #include <optional>
 #include <memory>
+#include <vector>
+#include <utility>
+#include <deque>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <filesystem>
+#include <unordered_map>
+#include <map>
+#include <list>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <new>
 
 // c
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+
+// linux
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
 /*
  * PKD = Protein Knot Detector
@@ -30,17 +57,111 @@
 namespace PKD {
 
 class CommandLineOptions {
+private:
+	// value of --name=value without modifying argv, nullptr when absent
+	static const char* value(int argc, char **argv, const char *name);
 public:
 // optional can be used as the return type of a factory that may fail
 	static std::optional<bool> output_each_iteration(int argc, char **argv);
 	static std::optional<std::string> output_type(int argc, char **argv);
 	static std::optional<std::string> input_type(int argc, char **argv);
 	static std::optional<std::string> input_file(int argc, char **argv);
+	// every chain of a .cif file is streamed to the smoothing threads
+	static std::optional<bool> stream_chains(int argc, char **argv);
+	static std::optional<unsigned int> threads(int argc, char **argv);
+	// verdicts are kept in this directory between runs
+	static std::optional<std::string> cache_dir(int argc, char **argv);
+	/* smoothing stops after this many milliseconds with a provisional
+	 * verdict, only for a single chain, the stream, trajectory and manifest
+	 * modes always smooth to convergence so their verdicts can be cached
+	 */
+	static std::optional<unsigned int> time_budget_ms(int argc, char **argv);
+	// hardware counters around each phase
+	static std::optional<bool> profile(int argc, char **argv);
+	// one path per line, screened in shards or merged
+	static std::optional<std::string> manifest(int argc, char **argv);
+	// --shard=i/N with 0 <= i < N
+	static std::optional<std::pair<unsigned int, unsigned int>> shard(int argc,
+			char **argv);
+	// --merge=N combines the results of N shards
+	static std::optional<unsigned int> merge(int argc, char **argv);
+	// result files are named after this prefix
+	static std::optional<std::string> results(int argc, char **argv);
+	// every model of a PDB file is a frame, .dcd input always is
+	static std::optional<bool> trajectory(int argc, char **argv);
+	// PDB file naming the atoms of a DCD trajectory
+	static std::optional<std::string> topology(int argc, char **argv);
+	// termini are moved out of the convex hull before smoothing
+	static std::optional<bool> extend_termini(int argc, char **argv);
+	// chains that cannot be knotted are not smoothed
+	static std::optional<bool> prescreen(int argc, char **argv);
+};
+
+// trace buffers start on a cache line, so vector loads never split one
+#define TRACE_POOL_ALIGNMENT 64
+// smallest buffer handed out, in floats
+#define TRACE_POOL_MIN_FLOATS 16
+// each thread and the shared depot keep at most this much for reuse
+#define TRACE_POOL_MAX_BYTES (64u << 20)
+#define TRACE_POOL_CLASSES 40
+/* buffers moved between a thread and the depot at once, a thread hands
+ * them over once it holds twice as many of one size. Kept small so a
+ * worker that frees one chain per job passes them on within a few jobs.
+ */
+#define TRACE_POOL_BATCH 4
+
+/*
+ * Per-thread free lists of aligned float buffers in power of two sizes.
+ * A buffer freed by a job is handed to the next job of the same thread
+ * that needs one of that size, so a long screen stops allocating once
+ * every size it meets has been seen. When one thread reads chains and
+ * others free them, the surplus of the freeing threads goes in batches to
+ * a shared depot, where the reading thread picks it up.
+ * The counters are shared by all threads.
+ */
+class TraceBufferPool {
+private:
+	struct FreeLists {
+		std::vector<float*> list[TRACE_POOL_CLASSES];
+		std::size_t bytes;
+		FreeLists();
+		~FreeLists();
+	};
+	struct Depot {
+		std::mutex mutex;
+		FreeLists freeLists;
+	};
+	static std::atomic<std::uint64_t> allocations_;
+	static std::atomic<std::uint64_t> reuses_;
+	static std::atomic<std::uint64_t> releases_;
+	static std::atomic<std::uint64_t> shared_;
+	static FreeLists* local();
+	static Depot& depot();
+	static int sizeClass(std::size_t nFloat);
+	static std::size_t classBytes(int sizeClass);
+	// moves up to n buffers of class c, the rest is given back to the heap
+	static void transfer(FreeLists &from, FreeLists &to, int c, std::size_t n);
+public:
+	// a buffer of at least nFloat floats
+	static float* acquire(std::size_t nFloat);
+	// nFloat has to be the size it was acquired with
+	static void release(float *buffer, std::size_t nFloat);
+	// buffers taken from the heap, reused from a free list and released
+	static std::uint64_t allocationCount();
+	static std::uint64_t reuseCount();
+	static std::uint64_t releaseCount();
+	// buffers taken from the depot, freed by another thread
+	static std::uint64_t sharedCount();
+	// bytes held for reuse by the calling thread
+	static std::size_t cachedBytes();
+	// gives the calling thread's free buffers back to the heap
+	static void trim();
 };
 
 /*
  * our s x 3 matrix
  * s = amino acid chain length
+ * The buffer comes from TraceBufferPool.
  */
 class DoubleMatrix {
 public:
@@ -54,12 +175,12 @@ public:
 	DoubleMatrix(std::size_t size) {
 		s = size;
 		n = s * 3;
-		m = new float[n];
+		m = TraceBufferPool::acquire(n);
 	}
 	DoubleMatrix(const DoubleMatrix&) = delete;
 	DoubleMatrix& operator=(const DoubleMatrix&) = delete;
 	~DoubleMatrix() {
-		delete[] m;
+		TraceBufferPool::release(m, n);
 	}
 	void printMatrix() {
 		for (size_t i = 0; i < n; i += 3) {
@@ -68,22 +189,951 @@ public:
 	}
 };
 
+/*
+ * Filtered geometric predicates for the intersection test.
+ * Every sign is first computed in double precision and trusted when it is
+ * larger than a certified bound on the round-off error. Only the cases
+ * that are too close to call fall back to exact expansion arithmetic,
+ * so near-degenerate strands can never slip through each other.
+ *
+ * Works Cited:
+ * Shewchuk, J. R. Adaptive Precision Floating-Point Arithmetic and Fast
+ * Robust Geometric Predicates. Discrete Comput. Geom. 18, 305-363 (1997)
+ */
+class GeometricPredicates {
+private:
+	static int growExpansion(double *e, int elen, double b);
+	static int scaleExpansion(const double *e, int elen, double b,
+			double *h);
+	static int multiplyExpansion(const double *e, int elen, const double *f,
+			int flen, double *h);
+	static int orient2dExact(const float *a, const float *b, const float *c,
+			int ax, int ay);
+	static int orient3dExact(const float *a, const float *b, const float *c,
+			const float *d);
+	static bool onSegment2d(const float *p, const float *q, const float *r,
+			int ax, int ay);
+	static bool segmentsIntersect2d(const float *p, const float *q,
+			const float *r, const float *s, int ax, int ay);
+	static bool coplanarSegmentTriangle(const float *p, const float *q,
+			const float *v0, const float *v1, const float *v2);
+public:
+	/* sign of the orientation of c relative to {a;b}
+	 * in the plane of coordinates ax and ay
+	 */
+	static int orient2d(const float *a, const float *b, const float *c,
+			int ax, int ay);
+	/* sign of the orientation of d relative to the plane {a,b,c} */
+	static int orient3d(const float *a, const float *b, const float *c,
+			const float *d);
+	/* true when segment {p;q} touches triangle {v0,v1,v2},
+	 * touching counts so a strand can never pass through an edge
+	 */
+	static bool segmentCrossesTriangle(const float *p, const float *q,
+			const float *v0, const float *v1, const float *v2);
+};
+
+/*
+ * Convex hull of a point set by quickhull. Every face keeps the list of
+ * points above it, so each point is only tested against the faces that
+ * replace the one it was seen from. The faces around a new point are
+ * found through a map of directed edges, which takes about n log n
+ * on protein traces.
+ *
+ * Works Cited:
+ * Barber, C. B., Dobkin, D. P. & Huhdanpaa, H. The Quickhull Algorithm for
+ * Convex Hulls. ACM Trans. Math. Softw. 22, 469-483 (1996)
+ */
+class ConvexHull {
+private:
+	struct Face {
+		std::size_t v[3];
+		// unit normal pointing out, normal . x = offset on the plane
+		double normal[3];
+		double offset;
+		std::vector<std::size_t> outside;
+		bool removed;
+	};
+	const float *x_;
+	double epsilon_;
+	std::vector<Face> faces_;
+	std::unordered_map<std::uint64_t, std::size_t> edges_;
+	double distance(const Face &face, const float *p);
+	std::size_t addFace(std::size_t a, std::size_t b, std::size_t c);
+	std::uint64_t edgeKey(std::size_t a, std::size_t b);
+	void assign(const std::vector<std::size_t> &points,
+			const std::vector<std::size_t> &candidates);
+public:
+	/* builds the hull of the n points at x, which must outlive the hull,
+	 * returns 0 on success and 1 when the points are all in one plane
+	 */
+	int build(const float *x, std::size_t n);
+	std::size_t faceCount();
+	/* distance from p, inside the hull, along the unit direction d
+	 * to the point where the ray leaves the hull
+	 */
+	double exitDistance(const float *p, const double *d);
+};
+
+// crossings that were not counted, or not in the frame of this chain
+#define KNOT_CROSSINGS_UNKNOWN UINT_MAX
+
+/*
+ * Verdict of one chain, as kept by KnotResultCache and the shard results.
+ * crossings are counted in the x, y and z projections of the smoothed
+ * chain, so they change when the chain is rotated. A chain that the
+ * pre-screen found unknotted is not smoothed, its crossings are
+ * KNOT_CROSSINGS_UNKNOWN.
+ */
+struct KnotResult {
+	bool knotted;
+	bool converged;
+	unsigned int sweeps;
+	unsigned int crossings;
+	std::size_t residues;
+	// skipped by KnotPrescreen, sweeps is 0
+	bool prescreened;
+};
+
+/*
+ * Best-so-far answer of a smoothing run that may have been stopped early.
+ * Crossings mostly go away as the chain straightens, so an unconverged
+ * "knotted" is less certain than an unconverged "unknotted".
+ * confidence is 1 once converged, otherwise the fraction of vertexes
+ * that no longer move.
+ */
+struct ProvisionalVerdict {
+	bool knotted;
+	bool converged;
+	bool interrupted;
+	unsigned int crossings;
+	unsigned int moving;
+	float confidence;
+};
+
+/*
+ * Signals of a chain that are cheap next to smoothing it.
+ */
+struct PrescreenResult {
+	std::size_t residues;
+	// of the residues, without the extended termini
+	double radiusOfGyration;
+	// fewest crossings over the projections, touching counts as crossing
+	unsigned int crossings;
+	// true when the chain is certainly unknotted and needs no smoothing
+	bool unknotted;
+};
+
+/*
+ * Triage before smoothing. A chain whose projection along some direction
+ * has no crossing at all can be pressed flat onto that plane and pulled
+ * straight without passing one strand through another, so it is unknotted
+ * whatever smoothing would make of it. So is a chain of fewer than 6
+ * vertexes, as a knotted polygon needs 6 edges.
+ * The crossings of a projection are found by sorting the projected
+ * segments on their lowest x and sweeping, so only segments whose x ranges
+ * overlap are compared. The sort is O(n log n), but the sweep still
+ * compares each segment with every segment its x range overlaps. That is
+ * about n^(2/3) segments for a compact globule and all of them in the worst
+ * case, so a projection is O(n^2) at worst, and there are 13 of them.
+ * Pairs too close to call count as crossings, the screen can only err
+ * towards smoothing a chain.
+ * The buffers are kept per thread, so screening does not allocate once
+ * a thread has seen its longest chain. The counters are shared by all
+ * threads.
+ */
+class KnotPrescreen {
+private:
+	struct Scratch {
+		std::vector<double> px, py, low, high;
+		std::vector<std::size_t> order, active;
+	};
+	static std::atomic<std::uint64_t> screened_;
+	static std::atomic<std::uint64_t> skipped_;
+	/* crossings of the chain projected along direction,
+	 * counting stops at limit
+	 */
+	static unsigned int projectionCrossings(const float *x,
+			std::size_t nVertex, const double *direction, unsigned int limit,
+			Scratch &scratch);
+public:
+	/* residues is how many of the vertexes are residues, the others are
+	 * the fixed termini added by TaylorKnotAlgorithm::extendTermini()
+	 */
+	static PrescreenResult screen(const DoubleMatrix &trace,
+			std::size_t residues);
+	static std::uint64_t screenedCount();
+	static std::uint64_t skippedCount();
+};
+
 /*
  * William R. Taylor Knot Detection Algorithm
  */
 class TaylorKnotAlgorithm {
 private:
 	std::unique_ptr<DoubleMatrix> m;
+	bool converged_;
+	bool interrupted_;
+	unsigned int moving_;
+	unsigned int sweeps_;
+	bool hasDeadline_;
+	std::chrono::steady_clock::time_point deadline_;
+	std::atomic<bool> cancelled_;
+	bool extendTermini_;
+	bool prescreen_;
+	bool stopRequested();
+	static bool fanUnobstructed(const float *x, std::size_t nVertex,
+			const std::vector<std::size_t> &kept, std::size_t b);
+	unsigned int smoothLevel(unsigned int stride, unsigned int maxRepeat);
 public:
+	TaylorKnotAlgorithm();
 	std::unique_ptr<DoubleMatrix> getMatrix();
-	void setMatrix(std::unique_ptr<DoubleMatrix> matrixPtr);
-	void smooth(unsigned int nRepeat);
-	void smoothAuto();
+	/* resume keeps the sweep count and the moving vertexes, for a trace
+	 * that getMatrix() returned and that was only read in between
+	 */
+	void setMatrix(std::unique_ptr<DoubleMatrix> matrixPtr,
+			bool resume = false);
+	/* returns the number of vertexes that moved in the last sweep */
+	unsigned int smooth(unsigned int nRepeat);
+	// sweeps of every smoothing call since the trace was set
+	unsigned int sweepCount();
+	/* smooths until no vertex moves, returns the number of sweeps */
+	unsigned int smoothAuto(unsigned int maxRepeat = 1000);
+	/* Smooths a coarse copy of the chain that keeps every stride-th
+	 * vertex, then refines it back to full resolution for the final
+	 * sweeps. Returns the total number of sweeps over all levels,
+	 * at most maxRepeat.
+	 */
+	unsigned int smoothMultiResolution(unsigned int stride = 4,
+			unsigned int maxRepeat = 1000);
+	/* An open chain has no knot type, so its verdict depends on the path
+	 * the smoothing takes and a coarse copy may untie a knot that full
+	 * resolution keeps. Only chains with extended termini are coarsened.
+	 */
+	static bool multiResolution(std::size_t residues, bool extendTermini);
+	bool isConverged();
+	/* fewest crossings of the chain projected along the x, y or z axis */
+	unsigned int crossingCount();
 	/* After about 50 iterations of smoothing,
 	 * the knot now may be detected.
 	 */
+	bool isKnotted();
+	/* Smoothing stops at the first sweep boundary after the deadline
+	 * or after cancel(), which may be called from another thread.
+	 * The trace is left as it was at that point.
+	 */
+	void setDeadline(std::chrono::steady_clock::time_point deadline);
+	void setTimeBudget(std::chrono::milliseconds budget);
+	void clearDeadline();
+	void cancel();
+	// true when the last smoothing call stopped before converging
+	bool isInterrupted();
+	ProvisionalVerdict verdict();
+	/* Returns a copy of the trace with one more vertex before the first
+	 * and after the last, outside the convex hull of the chain on the line
+	 * from its centre through the terminus. The chain keeps its shape and
+	 * both new ends stay fixed while it is smoothed.
+	 */
+	static std::unique_ptr<DoubleMatrix> extendTermini(
+			const DoubleMatrix &trace);
+	// detect() extends the termini before smoothing
+	void setExtendTermini(bool extendTermini);
+	/* detect() runs KnotPrescreen first and returns 0 sweeps
+	 * for a chain that cannot be knotted
+	 */
+	void setPrescreen(bool prescreen);
+	/* smooths the chain until converged, coarsening it first when
+	 * multiResolution() allows it, and returns the verdict
+	 */
+	KnotResult detect(std::unique_ptr<DoubleMatrix> matrixPtr);
+};
+
+// chains smoothed in lockstep by TaylorBatchAlgorithm
+#define TAYLOR_BATCH_LANES 8
+/* With fewer lanes moving, the lockstep sweep is slower than smoothing
+ * the chains one at a time
+ */
+#define TAYLOR_BATCH_MIN_LANES 4
+// the longest chain of a batch is at most this many times the shortest
+#define TAYLOR_BATCH_MAX_SPREAD 1.5
+
+/*
+ * Smooths up to TAYLOR_BATCH_LANES chains in lockstep, one chain per lane.
+ * The coordinates are interleaved as [vertex][axis][lane] so the move and
+ * the bounding box rejection of every segment run over all lanes at once.
+ * Lanes that are past the end of their chain, blocked or converged are
+ * masked. The few segments that pass the boxes go through the same exact
+ * predicates as TaylorKnotAlgorithm, so every chain ends up with the same
+ * coordinates and verdict as when it is smoothed alone.
+ * The lane loops are only vectorized at -O3, with GCC the batch kernel
+ * is built that way whatever the optimization level of the program.
+ */
+class TaylorBatchAlgorithm {
+private:
+	std::vector<float> x_;
+	std::vector<std::unique_ptr<DoubleMatrix>> matrices_;
+	std::size_t nVertex_;
+	std::size_t length_[TAYLOR_BATCH_LANES];
+	unsigned int sweeps_[TAYLOR_BATCH_LANES];
+	bool converged_[TAYLOR_BATCH_LANES];
+	void sweep(const int *active, unsigned int *nMoved);
+public:
+	TaylorBatchAlgorithm();
+	// packs at most TAYLOR_BATCH_LANES chains into the lanes
+	void setMatrices(std::vector<std::unique_ptr<DoubleMatrix>> matrices);
+	std::vector<std::unique_ptr<DoubleMatrix>> getMatrices();
+	/* smooths every lane until it converges, or until fewer than minLanes
+	 * lanes are still moving, returns the sweeps of the slowest
+	 */
+	unsigned int smoothAuto(unsigned int maxRepeat = 1000,
+			std::size_t minLanes = 1);
+	unsigned int sweepCount(std::size_t lane);
+	bool isConverged(std::size_t lane);
+	/* Same results as TaylorKnotAlgorithm::detect() on each chain. At least
+	 * TAYLOR_BATCH_MIN_LANES chains of similar length are batched together,
+	 * the others are smoothed alone, and so are the last lanes of a batch
+	 * once the rest have converged.
+	 * The smoothed coordinates are left in matrices. Chains skipped by the
+	 * pre-screen are not smoothed, but their termini are already extended
+	 * when extendTermini is set.
+	 */
+	static std::vector<KnotResult> detect(
+			std::vector<std::unique_ptr<DoubleMatrix>> &matrices,
+			bool extendTermini = false, bool prescreen = false);
+};
+
+/*
+ * Writes alpha carbon matrices straight to PDB or mmCIF text.
+ * The records are formatted from the coordinate buffer into one reusable
+ * output buffer, so no per-atom objects are created. Each call to
+ * writeFrame() appends one model, so a whole smoothing run can be
+ * saved to a single file.
+ * The PDB output matches what MMDB writes for the structure built by
+ * MMDBAndCarbonAlphaMatrix::toMMDB().
+ */
+class CarbonAlphaMatrixWriter {
+public:
+	enum Format {
+		PDB, CIF
+	};
+private:
+	FILE *file_;
+	std::string buffer_;
+	Format format_;
+	bool multiModel_;
+	bool conect_;
+	int frameCount_;
+	int atomCount_;
+	void appendLine(const char *line);
+public:
+	CarbonAlphaMatrixWriter();
+	CarbonAlphaMatrixWriter(const CarbonAlphaMatrixWriter&) = delete;
+	CarbonAlphaMatrixWriter& operator=(const CarbonAlphaMatrixWriter&) = delete;
+	~CarbonAlphaMatrixWriter();
+	/* multiModel wraps every frame in MODEL/ENDMDL records.
+	 * MMDB only writes these when there is more than one model.
+	 */
+	int open(const char *path, Format format = PDB, bool multiModel = false);
+	// CONECT records for the backbone bonds, MMDB does not write these
+	void setConect(bool conect);
+	const std::string& formatFrame(const DoubleMatrix &matrix);
+	int writeFrame(const DoubleMatrix &matrix);
+	int close();
+};
+
+/*
+ * The alpha carbon trace of one chain, as it is handed from the reader
+ * to the smoothing workers.
+ */
+struct ChainTrace {
+	int modelId;
+	std::string chainId;
+	std::unique_ptr<DoubleMatrix> matrix;
+};
+
+/*
+ * Streams the _atom_site loop of an mmCIF file and hands over the trace of
+ * every chain as soon as the next chain starts. Lines are tokenized in one
+ * reusable buffer and only the needed columns are kept, so memory is
+ * bounded by the largest chain instead of the whole file.
+ * Only the first alternate location of an atom is used. A chain whose atoms
+ * are not contiguous in the file is handed over once per run of atoms.
+ */
+class CIFCarbonAlphaStream {
+public:
+	typedef std::function<void(ChainTrace)> ChainCallback;
+private:
+	enum Column {
+		ATOM_ID, ALT_ID, TYPE_SYMBOL, ASYM_ID, MODEL_NUM, CARTN_X, CARTN_Y,
+		CARTN_Z, N_COLUMN
+	};
+	std::string line_;
+	std::vector<std::string> tags_;
+	std::vector<int> tagColumn_;
+	std::string value_[N_COLUMN];
+	std::vector<float> trace_;
+	int traceModel_;
+	std::string traceChain_;
+	bool firstModelOnly_;
+	std::size_t chainCount_;
+	int findTag(const char *name);
+	bool mapColumns();
+	bool addRow(const ChainCallback &callback);
+	void flush(const ChainCallback &callback);
+public:
+	CIFCarbonAlphaStream();
+	// stop after the first model, as the PDB path does
+	void setFirstModelOnly(bool firstModelOnly);
+	/* returns 0 on success, 1 when the file could not be opened and
+	 * 2 when it holds no _atom_site loop with coordinates
+	 */
+	int read(const char *path, const ChainCallback &callback);
+	std::size_t chainCount();
+};
+
+/*
+ * Runs the work function on jobs from nThreads threads.
+ * push() blocks while capacity jobs are waiting, so a fast reader
+ * can't get ahead of the smoothing by more than a fixed number of jobs.
+ */
+template<typename Job>
+class WorkerPool {
+public:
+	typedef std::function<void(Job&)> Worker;
+private:
+	std::deque<Job> queue_;
+	std::size_t capacity_;
+	bool closed_;
+	std::mutex mutex_;
+	std::condition_variable notEmpty_;
+	std::condition_variable notFull_;
+	std::vector<std::thread> threads_;
+	Worker worker_;
+	void run();
+public:
+	WorkerPool(unsigned int nThreads, std::size_t capacity, Worker worker);
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+	~WorkerPool();
+	void push(Job job);
+	// waits for every queued job to be processed
+	void finish();
+};
+
+typedef WorkerPool<ChainTrace> ChainWorkerPool;
+
+// traces of finished chains kept in memory, the least recently used go first
+#define KNOT_CACHE_MEMORY_BYTES (16u << 20)
+// cache files are written under one of this many locks, chosen by key
+#define KNOT_CACHE_FILE_LOCKS 16
+
+/*
+ * Content addressed store of knot verdicts, safe to share between threads.
+ * A trace is keyed by its rigid body invariants (principal moments and
+ * end-to-end distance, rounded to KNOT_CACHE_QUANTUM) and the algorithm
+ * parameters. A hit is only returned once the centred trace superimposes
+ * on the stored one within KNOT_CACHE_RMSD, so copies that were rotated
+ * or translated share one result while different chains never do.
+ * The crossings of a rotated copy differ from the stored ones, so a hit
+ * returns KNOT_CROSSINGS_UNKNOWN for them, and knotted is the verdict of
+ * the chain that was computed.
+ * A chain that is being computed by one thread is waited for by the others.
+ * Finished traces are kept up to KNOT_CACHE_MEMORY_BYTES. With a directory
+ * set, results are also appended to one file per key, which is where
+ * evicted chains are found again. Several processes on one host can share
+ * the directory. NFS does not append atomically, so a directory on NFS
+ * must only be written by one host at a time.
+ */
+class KnotResultCache {
+public:
+	typedef std::function<KnotResult()> Compute;
+private:
+	struct Entry {
+		std::uint64_t key;
+		std::string parameters;
+		std::vector<float> trace; // centred coordinates
+		std::shared_future<KnotResult> result;
+	};
+	std::string directory_;
+	std::mutex mutex_;
+	// chains being computed, they live on the stack of lookup()
+	std::unordered_multimap<std::uint64_t, const Entry*> inFlight_;
+	// most recently used first
+	std::list<Entry> finished_;
+	std::unordered_multimap<std::uint64_t, std::list<Entry>::iterator> finishedIndex_;
+	std::size_t finishedBytes_;
+	std::mutex fileMutex_[KNOT_CACHE_FILE_LOCKS];
+	std::size_t hitCount_;
+	std::size_t diskHitCount_;
+	std::size_t computeCount_;
+	static void jacobiEigenvalues(double *a, int n, double *eigenvalues);
+	static std::uint64_t key(const std::vector<float> &trace,
+			const std::string &parameters);
+	static double rmsd(const std::vector<float> &a,
+			const std::vector<float> &b);
+	std::string fileName(std::uint64_t key);
+	bool load(const Entry &entry, KnotResult &result);
+	int store(const Entry &entry, const KnotResult &result);
+	// moves a computed entry to finished_ and evicts, called under mutex_
+	void retire(Entry &entry);
+public:
+	KnotResultCache();
+	// empty keeps results in memory only
+	void setDirectory(const std::string &directory);
+	/* returns the stored verdict for this trace and parameters, or runs
+	 * compute once for all threads asking for the same chain
+	 */
+	KnotResult lookup(const DoubleMatrix &matrix,
+			const std::string &parameters, const Compute &compute,
+			bool *cached = nullptr);
+	std::size_t hitCount();
+	std::size_t diskHitCount();
+	std::size_t computeCount();
+};
+
+/*
+ * Hardware counters around the phases of the pipeline, read with
+ * perf_event_open on Linux. Counting is done for the calling thread only,
+ * user space only, so it works with the default perf_event_paranoid.
+ * The counters form one group led by the cycles, so they are scheduled
+ * together and the ratios come from the same time slices. When the PMU
+ * multiplexes the group, the counts are scaled by the time it was enabled
+ * over the time it was running.
+ * Counters the CPU or the virtual machine does not offer are reported as
+ * n/a, and on other systems only the wall time is measured.
+ */
+class PhaseProfiler {
+public:
+	enum Phase {
+		PARSE, EXTRACT, SMOOTH, DETECT, EXPORT, N_PHASE
+	};
+	enum Counter {
+		CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, N_COUNTER
+	};
+private:
+	struct Sample {
+		double milliseconds;
+		std::uint64_t counter[N_COUNTER];
+	};
+	int fd_[N_COUNTER];
+	// place of each counter in a read of the group
+	int slot_[N_COUNTER];
+	bool running_;
+	Phase phase_;
+	std::chrono::steady_clock::time_point wallStart_;
+	// followed by the time the group was enabled and running
+	std::uint64_t start_[N_COUNTER + 2];
+	std::string name_;
+	std::size_t residues_;
+	std::size_t structures_;
+	std::size_t structureCount_;
+	std::size_t residueTotal_;
+	Sample structure_[N_PHASE];
+	Sample total_[N_PHASE];
+	void readCounters(std::uint64_t *values);
+	void printTable(FILE *out, const Sample *samples);
+public:
+	PhaseProfiler();
+	PhaseProfiler(const PhaseProfiler&) = delete;
+	PhaseProfiler& operator=(const PhaseProfiler&) = delete;
+	~PhaseProfiler();
+	// returns the number of counters that could not be opened
+	int open();
+	void close();
+	void beginStructure(const std::string &name);
+	void setResidues(std::size_t residues);
+	/* chains that are profiled together as one structure,
+	 * each adds its residues and counts as a structure in the report
+	 */
+	void addResidues(std::size_t residues);
+	// starting a phase ends the one that is running
+	void begin(Phase phase);
+	void end();
+	/* adds the structure to the aggregate and prints it,
+	 * unless out is nullptr
+	 */
+	void endStructure(FILE *out = stdout);
+	// adds the aggregate of a profiler that ran on another thread
+	void merge(const PhaseProfiler &other);
+	void report(FILE *out = stdout);
+};
+
+/*
+ * One PhaseProfiler per worker thread, as the counters only count the
+ * thread that opened them. Merged into one report at the end.
+ */
+class ThreadProfilers {
+private:
+	std::mutex mutex_;
+	std::map<std::thread::id, std::unique_ptr<PhaseProfiler>> profilers_;
+public:
+	// profiler of the calling thread, the counters are opened on first use
+	PhaseProfiler& local();
+	void mergeInto(PhaseProfiler &profiler);
+};
+
+/*
+ * One entry of a screening manifest. The cost is the residue count
+ * squared, as every sweep checks each vertex against the whole chain.
+ * Results are keyed by the path as listed, the file is read from the
+ * path resolved against the directory of the manifest.
+ */
+struct ManifestEntry {
+	std::string path;
+	std::string resolvedPath;
+	std::size_t residues;
+	double cost;
+	unsigned int shard;
+};
+
+/*
+ * Splits a manifest into shards of about equal cost, so a job array on
+ * nodes that only share a filesystem can screen it without coordination.
+ * Every process derives the same plan from the manifest alone: entries are
+ * taken by decreasing cost, ties in manifest order, and each goes to the
+ * cheapest shard so far, ties to the lower index.
+ * A manifest line is a path optionally followed by the residue count,
+ * which is estimated from the file size when missing. Lines starting with
+ * # are comments.
+ * Each shard writes <prefix>.shard-<i>-of-<N>.tsv, one line per entry as
+ * soon as it is done, and merge() combines them in manifest order.
+ */
+class ShardPlan {
+public:
+	/* reads the chain of the file at path into matrix, returns 0 on success
+	 * or an error code that is written to the result file
+	 */
+	typedef std::function<
+			int(const std::string &path, std::unique_ptr<DoubleMatrix> &matrix)> Read;
+private:
+	std::vector<ManifestEntry> entries_;
+	std::vector<double> shardCost_;
+	static std::size_t estimateResidues(const std::string &path);
+public:
+	/* relative paths in the manifest are relative to its directory,
+	 * returns 0 on success and 1 when the manifest could not be read
+	 */
+	int load(const char *manifestPath);
+	void assign(unsigned int nShard);
+	const std::vector<ManifestEntry>& entries();
+	double shardCost(unsigned int shard);
+	static std::string resultFileName(const std::string &prefix,
+			unsigned int shard, unsigned int nShard);
+	/* Entries are read TAYLOR_BATCH_LANES at a time, smallest first, and
+	 * smoothed together by TaylorBatchAlgorithm. With a profiler, each
+	 * entry is read in the parse phase and each batch is one structure.
+	 * returns 0 on success, 1 when the result file could not be written
+	 * and 2 when an entry failed
+	 */
+	int run(unsigned int shard, const std::string &prefix, const Read &read,
+			bool extendTermini = false, bool prescreen = false,
+			PhaseProfiler *profiler = nullptr);
+	/* writes <prefix>.tsv and lists the entries that are missing or failed,
+	 * returns 0 when every entry has a result, 1 when the merged file could
+	 * not be written and 2 when entries are missing or failed
+	 */
+	int merge(const std::string &prefix, unsigned int nShard, FILE *report =
+			stdout);
+};
+
+/*
+ * A trajectory read one frame at a time, so its length is not limited
+ * by memory.
+ */
+class FrameSource {
+public:
+	virtual ~FrameSource() {
+	}
+	/* replaces trace with the alpha carbons of the next frame, returns 0,
+	 * 1 at the end of the trajectory and 2 on a read error
+	 */
+	virtual int readFrame(std::vector<float> &trace) = 0;
+};
+
+/*
+ * Frames of a multi-model PDB file such as an NMR ensemble. Every MODEL is
+ * one frame holding the alpha carbons of the chain that comes first, a
+ * file without MODEL records is a single frame.
+ */
+class PDBModelFrames: public FrameSource {
+private:
+	std::ifstream file_;
+	std::string line_;
+	char chainId_;
+public:
+	// returns 0 on success and 1 when the file could not be opened
+	int open(const char *path);
+	int readFrame(std::vector<float> &trace) override;
+	/* Indexes of the alpha carbons of the first chain among all atoms of
+	 * the first model, which is how DCD frames are ordered
+	 */
+	static int carbonAlphaIndices(const char *path,
+			std::vector<std::size_t> &indices);
+};
+
+/*
+ * Frames of a CHARMM or NAMD DCD file. The atoms are selected by a
+ * topology PDB written for the same system. Both byte orders are read,
+ * fixed atoms are not supported.
+ */
+class DCDFrames: public FrameSource {
+private:
+	FILE *file_;
+	bool swap_;
+	bool hasExtraBlock_;
+	bool has4D_;
+	std::size_t nAtom_;
+	std::vector<std::size_t> indices_;
+	std::vector<char> record_;
+	std::vector<float> coordinate_[3];
+	int readRecord();
+public:
+	DCDFrames();
+	DCDFrames(const DCDFrames&) = delete;
+	DCDFrames& operator=(const DCDFrames&) = delete;
+	~DCDFrames();
+	/* returns 0 on success, 1 when a file could not be opened and
+	 * 2 when the header does not describe a usable DCD file
+	 */
+	int open(const char *path, const char *topologyPath);
+	int readFrame(std::vector<float> &trace) override;
+};
+
+/*
+ * Knot verdict of one trajectory frame. A warm frame took the verdict of
+ * the last smoothed frame of its block without being smoothed, so it has
+ * no sweeps and KNOT_CROSSINGS_UNKNOWN, as a pre-screened frame does.
+ */
+struct FrameVerdict {
+	std::size_t frame;
+	bool knotted;
+	bool warm;
+	bool prescreened;
+	unsigned int crossings;
+	unsigned int sweeps;
+};
+
+/*
+ * Smooths the frames of a trajectory on nThreads threads. Frames are cut
+ * into blocks of contiguous frames and each block is given to one thread,
+ * so the frames of a block can be warm started from the frame before.
+ * The verdict of a smoothed frame is reused while no vertex has moved
+ * more than half of that frame's clearance, the shortest distance between
+ * two segments that don't share a vertex. Below that bound the straight
+ * path from one frame to the other can't pass one strand through another,
+ * so both frames have the same knot.
+ * Verdicts are handed to the output function in frame order.
+ */
+class TrajectoryAnalyzer {
+public:
+	typedef std::function<void(const FrameVerdict&)> Output;
+private:
+	struct Block {
+		std::size_t first;
+		std::size_t nFrame;
+		std::vector<float> coordinates;
+	};
+	unsigned int nThreads_;
+	std::size_t blockSize_;
+	std::size_t residues_;
+	std::size_t frameCount_;
+	std::size_t warmCount_;
+	double seconds_;
+	std::mutex mutex_;
+	std::map<std::size_t, std::vector<FrameVerdict>> done_;
+	std::size_t nextFrame_;
+	ThreadProfilers *profilers_;
+	bool extendTermini_;
+	bool prescreen_;
+	void analyzeBlock(Block &block, const Output &output);
+public:
+	TrajectoryAnalyzer(unsigned int nThreads, std::size_t blockSize = 64);
+	/* frames are smoothed as TaylorKnotAlgorithm::detect() smooths a single
+	 * chain with these options, the warm start compares extended traces
+	 */
+	void setExtendTermini(bool extendTermini);
+	void setPrescreen(bool prescreen);
+	/* every block is profiled on its worker thread,
+	 * the warm start check is the detect phase
+	 */
+	void setProfilers(ThreadProfilers *profilers);
+	/* returns 0 on success and 2 when a frame could not be read
+	 * or has a different number of residues
+	 */
+	int run(FrameSource &source, const Output &output);
+	std::size_t frameCount();
+	std::size_t warmCount();
+	double seconds();
+	// shortest distance between segments {p0;q0} and {p1;q1}
+	static double segmentDistance(const float *p0, const float *q0,
+			const float *p1, const float *q1);
+	static double clearance(const float *x, std::size_t nVertex);
+	static double maxDisplacement(const float *a, const float *b,
+			std::size_t nVertex);
+};
+
+/*
+ * Reads the alpha carbons of the first chain of the first model from a
+ * PDB or mmCIF file, the same chain the MMDB path selects, so the core
+ * detector can be built without a coordinate library.
+ */
+class CarbonAlphaReader {
+public:
+	/* returns 0 on success, 1 when the file could not be opened,
+	 * 2 when it holds no alpha carbons and 3 for other file types
+	 */
+	static int read(const char *path, std::unique_ptr<DoubleMatrix> &matrix);
 };
 
+std::atomic<std::uint64_t> TraceBufferPool::allocations_(0);
+std::atomic<std::uint64_t> TraceBufferPool::reuses_(0);
+std::atomic<std::uint64_t> TraceBufferPool::releases_(0);
+std::atomic<std::uint64_t> TraceBufferPool::shared_(0);
+
+TraceBufferPool::FreeLists::FreeLists() {
+	bytes = 0;
+}
+
+TraceBufferPool::FreeLists::~FreeLists() {
+	for (int c = 0; c < TRACE_POOL_CLASSES; c++) {
+		for (float *buffer : list[c]) {
+			::operator delete(buffer, std::align_val_t(TRACE_POOL_ALIGNMENT));
+		}
+	}
+}
+
+/* nullptr once the thread is exiting, its buffers have gone to the depot
+ * and new ones are given straight back to the heap
+ */
+TraceBufferPool::FreeLists* TraceBufferPool::local() {
+	static thread_local bool exited = false;
+	static thread_local struct Holder {
+		FreeLists freeLists;
+		~Holder() {
+			Depot &shared = depot();
+			std::lock_guard<std::mutex> lock(shared.mutex);
+			for (int c = 0; c < TRACE_POOL_CLASSES; c++) {
+				transfer(freeLists, shared.freeLists, c,
+						freeLists.list[c].size());
+			}
+			exited = true;
+		}
+	} holder;
+	return exited ? nullptr : &holder.freeLists;
+}
+
+TraceBufferPool::Depot& TraceBufferPool::depot() {
+	static Depot shared;
+	return shared;
+}
+
+int TraceBufferPool::sizeClass(std::size_t nFloat) {
+	int c = 0;
+	while (c + 1 < TRACE_POOL_CLASSES
+			&& ((std::size_t) TRACE_POOL_MIN_FLOATS << c) < nFloat) {
+		c++;
+	}
+	return c;
+}
+
+std::size_t TraceBufferPool::classBytes(int sizeClass) {
+	return ((std::size_t) TRACE_POOL_MIN_FLOATS << sizeClass) * sizeof(float);
+}
+
+void TraceBufferPool::transfer(FreeLists &from, FreeLists &to, int c,
+		std::size_t n) {
+	const std::size_t bytes = classBytes(c);
+	for (; n > 0 && !from.list[c].empty(); n--) {
+		float *buffer = from.list[c].back();
+		from.list[c].pop_back();
+		from.bytes -= bytes;
+		if (to.bytes + bytes > TRACE_POOL_MAX_BYTES) {
+			::operator delete(buffer, std::align_val_t(TRACE_POOL_ALIGNMENT));
+			continue;
+		}
+		to.list[c].push_back(buffer);
+		to.bytes += bytes;
+	}
+}
+
+float* TraceBufferPool::acquire(std::size_t nFloat) {
+	const int c = sizeClass(nFloat);
+	FreeLists *freeLists = local();
+	if (freeLists != nullptr && freeLists->list[c].empty()) {
+		Depot &shared = depot();
+		std::lock_guard<std::mutex> lock(shared.mutex);
+		transfer(shared.freeLists, *freeLists, c, TRACE_POOL_BATCH);
+		shared_.fetch_add(freeLists->list[c].size(), std::memory_order_relaxed);
+	}
+	if (freeLists != nullptr && !freeLists->list[c].empty()) {
+		float *buffer = freeLists->list[c].back();
+		freeLists->list[c].pop_back();
+		freeLists->bytes -= classBytes(c);
+		reuses_.fetch_add(1, std::memory_order_relaxed);
+		return buffer;
+	}
+	allocations_.fetch_add(1, std::memory_order_relaxed);
+	return static_cast<float*>(::operator new(classBytes(c),
+			std::align_val_t(TRACE_POOL_ALIGNMENT)));
+}
+
+void TraceBufferPool::release(float *buffer, std::size_t nFloat) {
+	const int c = sizeClass(nFloat);
+	FreeLists *freeLists = local();
+	if (buffer == nullptr) {
+		return;
+	}
+	releases_.fetch_add(1, std::memory_order_relaxed);
+	if (freeLists == nullptr
+			|| freeLists->bytes + classBytes(c) > TRACE_POOL_MAX_BYTES) {
+		::operator delete(buffer, std::align_val_t(TRACE_POOL_ALIGNMENT));
+		return;
+	}
+	freeLists->list[c].push_back(buffer);
+	freeLists->bytes += classBytes(c);
+	// a thread that only frees hands its surplus over
+	if (freeLists->list[c].size() >= 2 * TRACE_POOL_BATCH) {
+		Depot &shared = depot();
+		std::lock_guard<std::mutex> lock(shared.mutex);
+		transfer(*freeLists, shared.freeLists, c, TRACE_POOL_BATCH);
+	}
+}
+
+std::uint64_t TraceBufferPool::allocationCount() {
+	return allocations_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t TraceBufferPool::reuseCount() {
+	return reuses_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t TraceBufferPool::releaseCount() {
+	return releases_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t TraceBufferPool::sharedCount() {
+	return shared_.load(std::memory_order_relaxed);
+}
+
+std::size_t TraceBufferPool::cachedBytes() {
+	FreeLists *freeLists = local();
+	return freeLists ? freeLists->bytes : 0;
+}
+
+void TraceBufferPool::trim() {
+	FreeLists *freeLists = local();
+	if (freeLists == nullptr) {
+		return;
+	}
+	for (int c = 0; c < TRACE_POOL_CLASSES; c++) {
+		for (float *buffer : freeLists->list[c]) {
+			::operator delete(buffer, std::align_val_t(TRACE_POOL_ALIGNMENT));
+		}
+		freeLists->list[c].clear();
+	}
+	freeLists->bytes = 0;
+}
+
 std::optional<bool> CommandLineOptions::output_each_iteration(int argc,
 		char **argv) {
 	bool returnValue = { };
@@ -147,48 +1197,530 @@ std::optional<std::string> CommandLineOptions::input_type(int argc,
 
 std::optional<std::string> CommandLineOptions::input_file(int argc,
 		char **argv) {
-	std::string returnValue = { };
-	char * token;
-	for (int i = 0; i < argc; i++) {
-		token = strtok(argv[i], "=");
-		if (strcmp("--input_file", token) == 0) {
-			printf("WHYYY");
-			token = strtok(NULL, "=");
-			if (strcmp("", token) != 0) {
-				returnValue = token;
-			}
-			break;
+	const char *token = value(argc, argv, "--input_file");
+	if (token == nullptr || strcmp("", token) == 0) {
+		return std::nullopt;
+	}
+	return std::string(token);
+}
+
+const char* CommandLineOptions::value(int argc, char **argv,
+		const char *name) {
+	const std::size_t length = strlen(name);
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], name, length) == 0 && argv[i][length] == '=') {
+			return argv[i] + length + 1;
 		}
 	}
-	return returnValue;
+	return nullptr;
 }
 
-std::unique_ptr<DoubleMatrix> TaylorKnotAlgorithm::getMatrix() {
-	return std::move(m);
+std::optional<bool> CommandLineOptions::stream_chains(int argc, char **argv) {
+	const char *token = value(argc, argv, "--stream_chains");
+	if (token == nullptr) {
+		return std::nullopt;
+	}
+	if (strcmp("true", token) == 0) {
+		return true;
+	} else if (strcmp("false", token) != 0) {
+		printf("Warning: option 'stream_chains' invalid\n");
+	}
+	return false;
 }
-void TaylorKnotAlgorithm::setMatrix(std::unique_ptr<DoubleMatrix> matrixPtr) {
-	m = std::move(matrixPtr);
+
+std::optional<unsigned int> CommandLineOptions::threads(int argc,
+		char **argv) {
+	const char *token = value(argc, argv, "--threads");
+	char *end;
+	if (token == nullptr) {
+		return std::nullopt;
+	}
+	unsigned long n = strtoul(token, &end, 10);
+	if (*end != '\0' || n == 0) {
+		printf("Warning: option 'threads' invalid\n");
+		return std::nullopt;
+	}
+	return (unsigned int) n;
 }
 
-//#define TAYLOR_SMOOTH_DEBUG // show vertex info at each computation
-#define TAYLOR_SMOOTH_DEBUG_INTERSECT
-#define TAYLOR_SMOOTH_DEBUG_DEPTH 12
-// Copyright (C) 2016 by Doug Baldwin.
-// This work is licensed under a Creative Commons Attribution-ShareAlike 4.0 International
-// License (http://creativecommons.org/licenses/by-sa/4.0/).
-// High and low bounds on t values that are considered to represent a ray intersecting
-// a triangle's plane.
-#define tFar   10000.0f
-#define tNear  0.0000001f
-/* CROSS, DOT, and SUB3 Macros for 3-component vectors
- * used in original Moeller and Trumbore algorithm.
- *
- * Citation for macros from Moeller and Trumbore's original code
- * Created on: 1997
- * 		Author: Tomas Moeller -- Chalmers University of Technology
- * 		& Ben Trumbore -- Cornell University
- * 		Title:  Fast, Minimum Storage Ray /Triangle Intersection
- * 		Source: http://www.cs.virginia.edu/~gfx/Courses/2003/ImageSynthesis/papers/Acceleration/Fast%20MinimumStorage%20RayTriangle%20Intersection.pdf
+std::optional<std::string> CommandLineOptions::manifest(int argc,
+		char **argv) {
+	const char *token = value(argc, argv, "--manifest");
+	if (token == nullptr || strcmp("", token) == 0) {
+		return std::nullopt;
+	}
+	return std::string(token);
+}
+
+std::optional<std::pair<unsigned int, unsigned int>> CommandLineOptions::shard(
+		int argc, char **argv) {
+	const char *token = value(argc, argv, "--shard");
+	unsigned int i, n;
+	char end;
+	if (token == nullptr) {
+		return std::nullopt;
+	}
+	if (sscanf(token, "%u/%u%c", &i, &n, &end) != 2 || n == 0 || i >= n) {
+		printf("Warning: option 'shard' invalid\n");
+		return std::nullopt;
+	}
+	return std::make_pair(i, n);
+}
+
+std::optional<unsigned int> CommandLineOptions::merge(int argc, char **argv) {
+	const char *token = value(argc, argv, "--merge");
+	char *end;
+	if (token == nullptr) {
+		return std::nullopt;
+	}
+	unsigned long n = strtoul(token, &end, 10);
+	if (*end != '\0' || n == 0) {
+		printf("Warning: option 'merge' invalid\n");
+		return std::nullopt;
+	}
+	return (unsigned int) n;
+}
+
+std::optional<std::string> CommandLineOptions::results(int argc,
+		char **argv) {
+	const char *token = value(argc, argv, "--results");
+	if (token == nullptr || strcmp("", token) == 0) {
+		return std::nullopt;
+	}
+	return std::string(token);
+}
+
+std::optional<bool> CommandLineOptions::trajectory(int argc, char **argv) {
+	const char *token = value(argc, argv, "--trajectory");
+	if (token == nullptr) {
+		return std::nullopt;
+	}
+	if (strcmp("true", token) == 0) {
+		return true;
+	} else if (strcmp("false", token) != 0) {
+		printf("Warning: option 'trajectory' invalid\n");
+	}
+	return false;
+}
+
+std::optional<std::string> CommandLineOptions::topology(int argc,
+		char **argv) {
+	const char *token = value(argc, argv, "--topology");
+	if (token == nullptr || strcmp("", token) == 0) {
+		return std::nullopt;
+	}
+	return std::string(token);
+}
+
+std::optional<bool> CommandLineOptions::extend_termini(int argc,
+		char **argv) {
+	const char *token = value(argc, argv, "--extend_termini");
+	if (token == nullptr) {
+		return std::nullopt;
+	}
+	if (strcmp("true", token) == 0) {
+		return true;
+	} else if (strcmp("false", token) != 0) {
+		printf("Warning: option 'extend_termini' invalid\n");
+	}
+	return false;
+}
+
+std::optional<bool> CommandLineOptions::prescreen(int argc, char **argv) {
+	const char *token = value(argc, argv, "--prescreen");
+	if (token == nullptr) {
+		return std::nullopt;
+	}
+	if (strcmp("true", token) == 0) {
+		return true;
+	} else if (strcmp("false", token) != 0) {
+		printf("Warning: option 'prescreen' invalid\n");
+	}
+	return false;
+}
+
+std::optional<bool> CommandLineOptions::profile(int argc, char **argv) {
+	const char *token = value(argc, argv, "--profile");
+	if (token == nullptr) {
+		return std::nullopt;
+	}
+	if (strcmp("true", token) == 0) {
+		return true;
+	} else if (strcmp("false", token) != 0) {
+		printf("Warning: option 'profile' invalid\n");
+	}
+	return false;
+}
+
+std::optional<unsigned int> CommandLineOptions::time_budget_ms(int argc,
+		char **argv) {
+	const char *token = value(argc, argv, "--time_budget_ms");
+	char *end;
+	if (token == nullptr) {
+		return std::nullopt;
+	}
+	unsigned long n = strtoul(token, &end, 10);
+	if (*end != '\0' || *token == '\0') {
+		printf("Warning: option 'time_budget_ms' invalid\n");
+		return std::nullopt;
+	}
+	return (unsigned int) n;
+}
+
+std::optional<std::string> CommandLineOptions::cache_dir(int argc,
+		char **argv) {
+	const char *token = value(argc, argv, "--cache_dir");
+	if (token == nullptr || strcmp("", token) == 0) {
+		return std::nullopt;
+	}
+	return std::string(token);
+}
+
+TaylorKnotAlgorithm::TaylorKnotAlgorithm() {
+	converged_ = false;
+	interrupted_ = false;
+	moving_ = 0;
+	sweeps_ = 0;
+	hasDeadline_ = false;
+	cancelled_ = false;
+	extendTermini_ = false;
+	prescreen_ = false;
+}
+std::unique_ptr<DoubleMatrix> TaylorKnotAlgorithm::getMatrix() {
+	return std::move(m);
+}
+void TaylorKnotAlgorithm::setMatrix(std::unique_ptr<DoubleMatrix> matrixPtr,
+		bool resume) {
+	m = std::move(matrixPtr);
+	if (resume) {
+		return;
+	}
+	converged_ = false;
+	moving_ = m ? (unsigned int) m->s : 0;
+	sweeps_ = 0;
+}
+
+unsigned int TaylorKnotAlgorithm::sweepCount() {
+	return sweeps_;
+}
+
+void TaylorKnotAlgorithm::setDeadline(
+		std::chrono::steady_clock::time_point deadline) {
+	deadline_ = deadline;
+	hasDeadline_ = true;
+	interrupted_ = false;
+}
+
+void TaylorKnotAlgorithm::setTimeBudget(std::chrono::milliseconds budget) {
+	setDeadline(std::chrono::steady_clock::now() + budget);
+}
+
+void TaylorKnotAlgorithm::clearDeadline() {
+	hasDeadline_ = false;
+	interrupted_ = false;
+	cancelled_ = false;
+}
+
+void TaylorKnotAlgorithm::cancel() {
+	cancelled_ = true;
+}
+
+bool TaylorKnotAlgorithm::stopRequested() {
+	return cancelled_.load(std::memory_order_relaxed)
+			|| (hasDeadline_ && std::chrono::steady_clock::now() >= deadline_);
+}
+
+bool TaylorKnotAlgorithm::isInterrupted() {
+	return interrupted_;
+}
+
+/* Error free transformations used by the exact fallback.
+ * An expansion is a sum of doubles stored by increasing magnitude,
+ * so its sign is the sign of the last component.
+ */
+#define TWO_SUM(a, b, x, y)\
+		x = (a) + (b);\
+		{ double bVirtual = x - (a);\
+		double aVirtual = x - bVirtual;\
+		y = ((a) - aVirtual) + ((b) - bVirtual); }
+#define TWO_DIFF(a, b, x, y)\
+		x = (a) - (b);\
+		{ double bVirtual = (a) - x;\
+		double aVirtual = x + bVirtual;\
+		y = ((a) - aVirtual) + (bVirtual - (b)); }
+#define FAST_TWO_SUM(a, b, x, y)\
+		x = (a) + (b);\
+		y = (b) - (x - (a));
+#define TWO_PRODUCT(a, b, x, y)\
+		x = (a) * (b);\
+		y = std::fma((a), (b), -x);
+// Round-off bounds of the double precision path, epsilon = 2^-53
+#define PREDICATE_EPSILON 1.1102230246251565e-16
+#define ORIENT2D_ERRBOUND ((3.0 + 16.0 * PREDICATE_EPSILON) * PREDICATE_EPSILON)
+#define ORIENT3D_ERRBOUND ((7.0 + 56.0 * PREDICATE_EPSILON) * PREDICATE_EPSILON)
+
+/* adds b to the expansion e in place, returns the new length */
+int GeometricPredicates::growExpansion(double *e, int elen, double b) {
+	double Q, Qnew, hh;
+	int hindex = 0;
+	Q = b;
+	for (int eindex = 0; eindex < elen; eindex++) {
+		TWO_SUM(Q, e[eindex], Qnew, hh);
+		Q = Qnew;
+		if (hh != 0.0) {
+			e[hindex++] = hh;
+		}
+	}
+	if (Q != 0.0 || hindex == 0) {
+		e[hindex++] = Q;
+	}
+	return hindex;
+}
+
+int GeometricPredicates::scaleExpansion(const double *e, int elen, double b,
+		double *h) {
+	double Q, sum, hh, product1, product0;
+	int hindex = 0;
+	TWO_PRODUCT(e[0], b, Q, hh);
+	if (hh != 0.0) {
+		h[hindex++] = hh;
+	}
+	for (int eindex = 1; eindex < elen; eindex++) {
+		TWO_PRODUCT(e[eindex], b, product1, product0);
+		TWO_SUM(Q, product0, sum, hh);
+		if (hh != 0.0) {
+			h[hindex++] = hh;
+		}
+		FAST_TWO_SUM(product1, sum, Q, hh);
+		if (hh != 0.0) {
+			h[hindex++] = hh;
+		}
+	}
+	if (Q != 0.0 || hindex == 0) {
+		h[hindex++] = Q;
+	}
+	return hindex;
+}
+
+/* h needs room for 2 * elen * flen components */
+int GeometricPredicates::multiplyExpansion(const double *e, int elen,
+		const double *f, int flen, double *h) {
+	double scaled[64];
+	int hlen = 0;
+	for (int j = 0; j < flen; j++) {
+		int slen = scaleExpansion(e, elen, f[j], scaled);
+		for (int k = 0; k < slen; k++) {
+			hlen = growExpansion(h, hlen, scaled[k]);
+		}
+	}
+	return hlen;
+}
+
+int GeometricPredicates::orient2dExact(const float *a, const float *b,
+		const float *c, int ax, int ay) {
+	double acx[2], bcy[2], acy[2], bcx[2];
+	double left[16], right[8];
+	int llen, rlen;
+	TWO_DIFF((double ) a[ax], (double ) c[ax], acx[1], acx[0]);
+	TWO_DIFF((double ) b[ay], (double ) c[ay], bcy[1], bcy[0]);
+	TWO_DIFF((double ) a[ay], (double ) c[ay], acy[1], acy[0]);
+	TWO_DIFF((double ) b[ax], (double ) c[ax], bcx[1], bcx[0]);
+	llen = multiplyExpansion(acx, 2, bcy, 2, left);
+	rlen = multiplyExpansion(acy, 2, bcx, 2, right);
+	for (int k = 0; k < rlen; k++) {
+		llen = growExpansion(left, llen, -right[k]);
+	}
+	return (left[llen - 1] > 0.0) - (left[llen - 1] < 0.0);
+}
+
+int GeometricPredicates::orient2d(const float *a, const float *b,
+		const float *c, int ax, int ay) {
+	const double detleft = ((double) a[ax] - c[ax]) * ((double) b[ay] - c[ay]);
+	const double detright = ((double) a[ay] - c[ay]) * ((double) b[ax] - c[ax]);
+	const double det = detleft - detright;
+	const double errbound = ORIENT2D_ERRBOUND
+			* (fabs(detleft) + fabs(detright));
+	if (det > errbound) {
+		return 1;
+	} else if (-det > errbound) {
+		return -1;
+	}
+	return orient2dExact(a, b, c, ax, ay);
+}
+
+int GeometricPredicates::orient3dExact(const float *a, const float *b,
+		const float *c, const float *d) {
+	double ad[3][2], bd[3][2], cd[3][2];
+	double part[16], minor[16], term[64], det[192];
+	int plen, mlen, tlen, dlen;
+	for (int i = 0; i < 3; i++) {
+		TWO_DIFF((double ) a[i], (double ) d[i], ad[i][1], ad[i][0]);
+		TWO_DIFF((double ) b[i], (double ) d[i], bd[i][1], bd[i][0]);
+		TWO_DIFF((double ) c[i], (double ) d[i], cd[i][1], cd[i][0]);
+	}
+	/* det = adz (bdx cdy - cdx bdy) + bdz (cdx ady - adx cdy)
+	 *     + cdz (adx bdy - bdx ady)
+	 */
+	const double *rows[3][5] = { { ad[2], bd[0], cd[1], cd[0], bd[1] }, {
+			bd[2], cd[0], ad[1], ad[0], cd[1] }, { cd[2], ad[0], bd[1], bd[0],
+			ad[1] } };
+	dlen = 0;
+	for (int r = 0; r < 3; r++) {
+		mlen = multiplyExpansion(rows[r][1], 2, rows[r][2], 2, minor);
+		plen = multiplyExpansion(rows[r][3], 2, rows[r][4], 2, part);
+		for (int k = 0; k < plen; k++) {
+			mlen = growExpansion(minor, mlen, -part[k]);
+		}
+		tlen = multiplyExpansion(minor, mlen, rows[r][0], 2, term);
+		for (int k = 0; k < tlen; k++) {
+			dlen = growExpansion(det, dlen, term[k]);
+		}
+	}
+	return (det[dlen - 1] > 0.0) - (det[dlen - 1] < 0.0);
+}
+
+int GeometricPredicates::orient3d(const float *a, const float *b,
+		const float *c, const float *d) {
+	const double adx = (double) a[0] - d[0];
+	const double bdx = (double) b[0] - d[0];
+	const double cdx = (double) c[0] - d[0];
+	const double ady = (double) a[1] - d[1];
+	const double bdy = (double) b[1] - d[1];
+	const double cdy = (double) c[1] - d[1];
+	const double adz = (double) a[2] - d[2];
+	const double bdz = (double) b[2] - d[2];
+	const double cdz = (double) c[2] - d[2];
+	const double bdxcdy = bdx * cdy;
+	const double cdxbdy = cdx * bdy;
+	const double cdxady = cdx * ady;
+	const double adxcdy = adx * cdy;
+	const double adxbdy = adx * bdy;
+	const double bdxady = bdx * ady;
+	const double det = adz * (bdxcdy - cdxbdy) + bdz * (cdxady - adxcdy)
+			+ cdz * (adxbdy - bdxady);
+	const double permanent = (fabs(bdxcdy) + fabs(cdxbdy)) * fabs(adz)
+			+ (fabs(cdxady) + fabs(adxcdy)) * fabs(bdz)
+			+ (fabs(adxbdy) + fabs(bdxady)) * fabs(cdz);
+	const double errbound = ORIENT3D_ERRBOUND * permanent;
+	if (det > errbound) {
+		return 1;
+	} else if (-det > errbound) {
+		return -1;
+	}
+	return orient3dExact(a, b, c, d);
+}
+
+/* r is collinear with {p;q}, check that it lies between them */
+bool GeometricPredicates::onSegment2d(const float *p, const float *q,
+		const float *r, int ax, int ay) {
+	return std::min(p[ax], q[ax]) <= r[ax] && r[ax] <= std::max(p[ax], q[ax])
+			&& std::min(p[ay], q[ay]) <= r[ay] && r[ay] <= std::max(p[ay], q[ay]);
+}
+
+bool GeometricPredicates::segmentsIntersect2d(const float *p, const float *q,
+		const float *r, const float *s, int ax, int ay) {
+	const int o1 = orient2d(p, q, r, ax, ay);
+	const int o2 = orient2d(p, q, s, ax, ay);
+	const int o3 = orient2d(r, s, p, ax, ay);
+	const int o4 = orient2d(r, s, q, ax, ay);
+	if (o1 * o2 < 0 && o3 * o4 < 0) {
+		return true;
+	}
+	return (o1 == 0 && onSegment2d(p, q, r, ax, ay))
+			|| (o2 == 0 && onSegment2d(p, q, s, ax, ay))
+			|| (o3 == 0 && onSegment2d(r, s, p, ax, ay))
+			|| (o4 == 0 && onSegment2d(r, s, q, ax, ay));
+}
+
+/*
+ * Both end points lie in the plane of the triangle. The test is done in
+ * the coordinate plane where the triangle keeps its area. A triangle with
+ * no area sweeps nothing when the vertex moves, so it is never crossed.
+ */
+bool GeometricPredicates::coplanarSegmentTriangle(const float *p,
+		const float *q, const float *v0, const float *v1, const float *v2) {
+	int ax = 0, ay = 1, area = 0;
+	for (int axis = 0; axis < 3 && area == 0; axis++) {
+		ax = (axis + 1) % 3;
+		ay = (axis + 2) % 3;
+		area = orient2d(v0, v1, v2, ax, ay);
+	}
+	if (area == 0) {
+		return false;
+	}
+	for (const float *r : { p, q }) {
+		const int o0 = orient2d(v0, v1, r, ax, ay) * area;
+		const int o1 = orient2d(v1, v2, r, ax, ay) * area;
+		const int o2 = orient2d(v2, v0, r, ax, ay) * area;
+		if (o0 >= 0 && o1 >= 0 && o2 >= 0) {
+			return true;
+		}
+	}
+	return segmentsIntersect2d(p, q, v0, v1, ax, ay)
+			|| segmentsIntersect2d(p, q, v1, v2, ax, ay)
+			|| segmentsIntersect2d(p, q, v2, v0, ax, ay);
+}
+
+bool GeometricPredicates::segmentCrossesTriangle(const float *p,
+		const float *q, const float *v0, const float *v1, const float *v2) {
+	// bounding boxes compare floats exactly, most segments stop here
+	for (int i = 0; i < 3; i++) {
+		const float low = std::min(v0[i], std::min(v1[i], v2[i]));
+		const float high = std::max(v0[i], std::max(v1[i], v2[i]));
+		if ((p[i] < low && q[i] < low) || (p[i] > high && q[i] > high)) {
+			return false;
+		}
+	}
+	const int s1 = orient3d(v0, v1, v2, p);
+	const int s2 = orient3d(v0, v1, v2, q);
+	if (s1 == s2 && s1 != 0) {
+		return false;
+	}
+	if (s1 == 0 && s2 == 0) {
+		return coplanarSegmentTriangle(p, q, v0, v1, v2);
+	}
+	// the line {p;q} has to pass inside all three edges
+	const int t1 = orient3d(p, q, v0, v1);
+	const int t2 = orient3d(p, q, v1, v2);
+	const int t3 = orient3d(p, q, v2, v0);
+	return (t1 >= 0 && t2 >= 0 && t3 >= 0) || (t1 <= 0 && t2 <= 0 && t3 <= 0);
+}
+
+//#define TAYLOR_SMOOTH_DEBUG // show vertex info at each computation
+//#define TAYLOR_SMOOTH_DEBUG_INTERSECT // show every blocked vertex
+#define TAYLOR_SMOOTH_DEBUG_DEPTH 12
+/* A vertex only counts as moved when the squared distance is larger
+ * than this, otherwise the sweeps would never be reported as converged.
+ */
+#define TAYLOR_MOVE_EPSILON 0.0001f
+/* An unknotted chain is pulled straight between the termini. A knot stays
+ * behind as a tangle that shows at least 3 crossings in every projection,
+ * however tight it gets.
+ */
+#define TAYLOR_KNOT_MIN_CROSSINGS 3
+// Chains shorter than this are not worth coarsening
+#define TAYLOR_MULTIRES_MIN 64
+/* detect() smooths longer chains with extended termini on a coarse copy
+ * first. Building with TAYLOR_MULTIRES_CHECK also smooths every such chain
+ * at full resolution and reports when the verdicts differ; lower this
+ * to check the knotted chains in commandLine/ as well.
+ */
+#ifndef TAYLOR_MULTIRES_LENGTH
+#define TAYLOR_MULTIRES_LENGTH 1000
+#endif
+/* Extended termini are this many times farther from the centre of the
+ * chain than the point where they leave its convex hull
+ */
+#define TAYLOR_EXTENSION_FACTOR 2.0
+/* CROSS, DOT, and SUB3 Macros for 3-component vectors
+ * used in original Moeller and Trumbore algorithm.
+ *
+ * Citation for macros from Moeller and Trumbore's original code
+ * Created on: 1997
+ * 		Author: Tomas Moeller -- Chalmers University of Technology
+ * 		& Ben Trumbore -- Cornell University
+ * 		Title:  Fast, Minimum Storage Ray /Triangle Intersection
+ * 		Source: http://www.cs.virginia.edu/~gfx/Courses/2003/ImageSynthesis/papers/Acceleration/Fast%20MinimumStorage%20RayTriangle%20Intersection.pdf
  */
 #define CROSS(res, v1, v2)\
 		res[0]=v1[1]*v2[2]-v1[2]*v2[1];\
@@ -204,16 +1736,23 @@ void TaylorKnotAlgorithm::setMatrix(std::unique_ptr<DoubleMatrix> matrixPtr) {
  * Function calls would create too much overhead so we use #define
  * for maximum computational efficiency
  */
-void TaylorKnotAlgorithm::smooth(unsigned int nRepeat = 1) {
+unsigned int TaylorKnotAlgorithm::smooth(unsigned int nRepeat = 1) {
 	float *x = m->m; // x is an alias for the vertex matrix
-	float *v0, *v1, *v2, *v0a, *v1a, *v2a, *rayOrigin, *rayDirection;
-	float v1p[3];
+	float *v0, *v1, *v2, *v0a, *v1a, *v2a, *segmentStart, *segmentEnd;
+	float v1p[3], d[3];
+	unsigned int nMoved = 0;
 	/* v# are the operated vertexes
 	 * v#a are the committed vertexes
 	 * v#p are the prime vertexes (vertex after move)
 	 */
 	int n = m->n - 3;
 	for (unsigned int j = 0; j < nRepeat; j++) {
+		if (j > 0 && stopRequested()) {
+			interrupted_ = true;
+			break;
+		}
+		sweeps_++;
+		nMoved = 0;
 		for (int i = 3; i < n; i += 3) {
 			v0a = x + i - 3;
 			v1a = x + i;
@@ -232,62 +1771,43 @@ void TaylorKnotAlgorithm::smooth(unsigned int nRepeat = 1) {
 			/* check that the triangles {i'-1,i,i'} and {i;i';i+1}
 			 * did not intersect any line segment {j'-1;j'}(j<i) before the move point
 			 * or any line {j;j+1}(j>i) following.
-			 * implemented with the MllerTrumbore intersection algorithm
+			 * implemented with the filtered predicates of GeometricPredicates,
+			 * the exact fallback only runs when the float path is too close to call
 			 *
-			 * This code is repeated 4 times to check intersection for each of two triangles twice.
-			 * Creating a function for this repeated code would create too much of an overhead
-			 * so the code is just copied and pasted 4 times.
+			 * This loop is repeated 4 times to check intersection for each of two triangles twice.
+			 */
+			/* segments sharing a vertex with the triangle always touch it,
+			 * so {i-2;i-1} and {i+1;i+2} are skipped where they do
 			 */
 			// triangle {i'-1,i,i'} and line {j'-1;j'}(j<i)
 			v0 = v0a;
 			v1 = v1a;
 			v2 = v1p;
-			for (int k = 3; k < i; k += 3) {
-				rayOrigin = x + k - 3; // setup ray
-				rayDirection = x + k;
+			for (int k = 3; k < i - 3; k += 3) {
+				segmentStart = x + k - 3; // setup segment
+				segmentEnd = x + k;
 #ifdef TAYLOR_SMOOTH_DEBUG
 				if (i < TAYLOR_SMOOTH_DEBUG_DEPTH && k < TAYLOR_SMOOTH_DEBUG_DEPTH) {
 					printf(
 							"i#%d k#%d triangle {i'-1,i,i'} and line {j'-1;j'}(j<i)\nTRI{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)} line{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)}\n",
 							i, k, v0[0], v0[1], v0[2], v1[0], v1[1], v1[2],
-							v2[0], v2[1], v2[2], rayOrigin[0], rayOrigin[1],
-							rayOrigin[2], rayDirection[0], rayDirection[1],
-							rayDirection[2]);
+							v2[0], v2[1], v2[2], segmentStart[0], segmentStart[1],
+							segmentStart[2], segmentEnd[0], segmentEnd[1],
+							segmentEnd[2]);
 				}
 #endif
-				float edge1[3]; // Find vectors for two edges sharing vertex 0
-				SUB3(edge1, v1, v0);
-				float edge2[3];
-				SUB3(edge2, v2, v0);
-				float pvec[3]; // Begin calculating determinant;
-				CROSS(pvec, rayDirection, edge2); // also used to calculate U parameter
-				const float det = DOT(edge1, pvec); // If determinant is near zero, ray lies in plane of triangle
-				if (det > -0.000001f && det < 0.000001f) // No backface culling in this experiment, determinant within "epsilon" as
-					continue; // defined in M&T paper is considered 0
-				const float inv_det = 1.0f / det;
-				float tvec[3]; // Calculate vector from vertex to ray origin
-				SUB3(tvec, rayOrigin, v0);
-				const float u = DOT( tvec, pvec) * inv_det; // Calculate U parameter and test bounds
-				if (u < 0.0f || u > 1.0f)
-					continue;
-				float qvec[3]; // Prepare to test V parameter
-				CROSS(qvec, tvec, edge1);
-				const float v = DOT( rayDirection, qvec ) * inv_det; // Calculate V parameter and test bounds
-				if (v < 0.0f || u + v >= 1.0f)
+				if (!GeometricPredicates::segmentCrossesTriangle(segmentStart,
+						segmentEnd, v0, v1, v2))
 					continue;
-				const float t = DOT( edge2, qvec ) * inv_det; // Calculate t, final check to see if ray intersects triangle. Test to
-				if (t <= tNear || t >= tFar) // see if t > tFar added for consistency with other algorithms in experiment.
-					continue;
-				// intersection found, don't move vertex
 #ifdef TAYLOR_SMOOTH_DEBUG_INTERSECT
 				if (i < TAYLOR_SMOOTH_DEBUG_DEPTH
 						&& k < TAYLOR_SMOOTH_DEBUG_DEPTH) {
 					printf(
 							"i#%d k#%d triangle {i'-1,i,i'} and line {j'-1;j'}(j<i)\nTRI{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)} line{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)}\n",
 							i, k, v0[0], v0[1], v0[2], v1[0], v1[1], v1[2],
-							v2[0], v2[1], v2[2], rayOrigin[0], rayOrigin[1],
-							rayOrigin[2], rayDirection[0], rayDirection[1],
-							rayDirection[2]);
+							v2[0], v2[1], v2[2], segmentStart[0], segmentStart[1],
+							segmentStart[2], segmentEnd[0], segmentEnd[1],
+							segmentEnd[2]);
 				}
 #endif
 				goto intersect;
@@ -298,40 +1818,20 @@ void TaylorKnotAlgorithm::smooth(unsigned int nRepeat = 1) {
 			v1 = v1p;
 			v2 = v2a;
 			for (int k = 3; k < i; k += 3) {
-				rayOrigin = x + k - 3;
-				rayDirection = x + k;
+				segmentStart = x + k - 3;
+				segmentEnd = x + k;
 #ifdef TAYLOR_SMOOTH_DEBUG
 				if (i < TAYLOR_SMOOTH_DEBUG_DEPTH && k < TAYLOR_SMOOTH_DEBUG_DEPTH) {
 					printf(
 							"i#%d k#%d triangle {i;i';i+1} and line {j'-1;j'}(j<i)\nTRI{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)} line{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)}\n",
 							i, k, v0[0], v0[1], v0[2], v1[0], v1[1], v1[2],
-							v2[0], v2[1], v2[2], rayOrigin[0], rayOrigin[1],
-							rayOrigin[2], rayDirection[0], rayDirection[1],
-							rayDirection[2]);
+							v2[0], v2[1], v2[2], segmentStart[0], segmentStart[1],
+							segmentStart[2], segmentEnd[0], segmentEnd[1],
+							segmentEnd[2]);
 				}
 #endif
-				float edge1[3];
-				SUB3(edge1, v1, v0);
-				float edge2[3];
-				SUB3(edge2, v2, v0);
-				float pvec[3];
-				CROSS(pvec, rayDirection, edge2);
-				const float det = DOT(edge1, pvec);
-				if (det > -0.000001f && det < 0.000001f)
-					continue;
-				const float inv_det = 1.0f / det;
-				float tvec[3];
-				SUB3(tvec, rayOrigin, v0);
-				const float u = DOT( tvec, pvec) * inv_det;
-				if (u < 0.0f || u > 1.0f)
-					continue;
-				float qvec[3];
-				CROSS(qvec, tvec, edge1);
-				const float v = DOT( rayDirection, qvec ) * inv_det;
-				if (v < 0.0f || u + v >= 1.0f)
-					continue;
-				const float t = DOT( edge2, qvec ) * inv_det;
-				if (t <= tNear || t >= tFar)
+				if (!GeometricPredicates::segmentCrossesTriangle(segmentStart,
+						segmentEnd, v0, v1, v2))
 					continue;
 #ifdef TAYLOR_SMOOTH_DEBUG_INTERSECT
 				if (i < TAYLOR_SMOOTH_DEBUG_DEPTH
@@ -339,9 +1839,9 @@ void TaylorKnotAlgorithm::smooth(unsigned int nRepeat = 1) {
 					printf(
 							"i#%d k#%d triangle {i;i';i+1} and line {j'-1;j'}(j<i)\nTRI{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)} line{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)}\n",
 							i, k, v0[0], v0[1], v0[2], v1[0], v1[1], v1[2],
-							v2[0], v2[1], v2[2], rayOrigin[0], rayOrigin[1],
-							rayOrigin[2], rayDirection[0], rayDirection[1],
-							rayDirection[2]);
+							v2[0], v2[1], v2[2], segmentStart[0], segmentStart[1],
+							segmentStart[2], segmentEnd[0], segmentEnd[1],
+							segmentEnd[2]);
 				}
 #endif
 				goto intersect;
@@ -352,40 +1852,20 @@ void TaylorKnotAlgorithm::smooth(unsigned int nRepeat = 1) {
 			v1 = v1a;
 			v2 = v1p;
 			for (int k = i + 3; k < n; k += 3) {
-				rayOrigin = x + k; // setup ray
-				rayDirection = x + k + 3;
+				segmentStart = x + k; // setup segment
+				segmentEnd = x + k + 3;
 #ifdef TAYLOR_SMOOTH_DEBUG
 				if (i < TAYLOR_SMOOTH_DEBUG_DEPTH && k < TAYLOR_SMOOTH_DEBUG_DEPTH) {
 					printf(
 							"i#%d k#%d triangle {i'-1,i,i'} and line {j;j+1}(j>i)\nTRI{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)} line{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)}\n",
 							i, k, v0[0], v0[1], v0[2], v1[0], v1[1], v1[2],
-							v2[0], v2[1], v2[2], rayOrigin[0], rayOrigin[1],
-							rayOrigin[2], rayDirection[0], rayDirection[1],
-							rayDirection[2]);
+							v2[0], v2[1], v2[2], segmentStart[0], segmentStart[1],
+							segmentStart[2], segmentEnd[0], segmentEnd[1],
+							segmentEnd[2]);
 				}
 #endif
-				float edge1[3];
-				SUB3(edge1, v1, v0);
-				float edge2[3];
-				SUB3(edge2, v2, v0);
-				float pvec[3];
-				CROSS(pvec, rayDirection, edge2);
-				const float det = DOT(edge1, pvec);
-				if (det > -0.000001f && det < 0.000001f)
-					continue;
-				const float inv_det = 1.0f / det;
-				float tvec[3];
-				SUB3(tvec, rayOrigin, v0);
-				const float u = DOT( tvec, pvec) * inv_det;
-				if (u < 0.0f || u > 1.0f)
-					continue;
-				float qvec[3];
-				CROSS(qvec, tvec, edge1);
-				const float v = DOT( rayDirection, qvec ) * inv_det;
-				if (v < 0.0f || u + v >= 1.0f)
-					continue;
-				const float t = DOT( edge2, qvec ) * inv_det;
-				if (t <= tNear || t >= tFar)
+				if (!GeometricPredicates::segmentCrossesTriangle(segmentStart,
+						segmentEnd, v0, v1, v2))
 					continue;
 #ifdef TAYLOR_SMOOTH_DEBUG_INTERSECT
 				if (i < TAYLOR_SMOOTH_DEBUG_DEPTH
@@ -393,9 +1873,9 @@ void TaylorKnotAlgorithm::smooth(unsigned int nRepeat = 1) {
 					printf(
 							"i#%d k#%d triangle {i'-1,i,i'} and line {j;j+1}(j>i)\nTRI{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)} line{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)}\n",
 							i, k, v0[0], v0[1], v0[2], v1[0], v1[1], v1[2],
-							v2[0], v2[1], v2[2], rayOrigin[0], rayOrigin[1],
-							rayOrigin[2], rayDirection[0], rayDirection[1],
-							rayDirection[2]);
+							v2[0], v2[1], v2[2], segmentStart[0], segmentStart[1],
+							segmentStart[2], segmentEnd[0], segmentEnd[1],
+							segmentEnd[2]);
 				}
 #endif
 				goto intersect;
@@ -405,41 +1885,21 @@ void TaylorKnotAlgorithm::smooth(unsigned int nRepeat = 1) {
 			v0 = v1a;
 			v1 = v1p;
 			v2 = v2a;
-			for (int k = i + 3; k < n; k += 3) {
-				rayOrigin = x + k;
-				rayDirection = x + k + 3;
+			for (int k = i + 6; k < n; k += 3) {
+				segmentStart = x + k;
+				segmentEnd = x + k + 3;
 #ifdef TAYLOR_SMOOTH_DEBUG
 				if (i < TAYLOR_SMOOTH_DEBUG_DEPTH && k < TAYLOR_SMOOTH_DEBUG_DEPTH) {
 					printf(
 							"i#%d k#%d triangle {i;i';i+1} and line {j;j+1}(j>i)\nTRI{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)} line{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)}\n",
 							i, k, v0[0], v0[1], v0[2], v1[0], v1[1], v1[2],
-							v2[0], v2[1], v2[2], rayOrigin[0], rayOrigin[1],
-							rayOrigin[2], rayDirection[0], rayDirection[1],
-							rayDirection[2]);
+							v2[0], v2[1], v2[2], segmentStart[0], segmentStart[1],
+							segmentStart[2], segmentEnd[0], segmentEnd[1],
+							segmentEnd[2]);
 				}
 #endif
-				float edge1[3];
-				SUB3(edge1, v1, v0);
-				float edge2[3];
-				SUB3(edge2, v2, v0);
-				float pvec[3];
-				CROSS(pvec, rayDirection, edge2);
-				const float det = DOT(edge1, pvec);
-				if (det > -0.000001f && det < 0.000001f)
-					continue;
-				const float inv_det = 1.0f / det;
-				float tvec[3];
-				SUB3(tvec, rayOrigin, v0);
-				const float u = DOT( tvec, pvec) * inv_det;
-				if (u < 0.0f || u > 1.0f)
-					continue;
-				float qvec[3];
-				CROSS(qvec, tvec, edge1);
-				const float v = DOT( rayDirection, qvec ) * inv_det;
-				if (v < 0.0f || u + v >= 1.0f)
-					continue;
-				const float t = DOT( edge2, qvec ) * inv_det;
-				if (t <= tNear || t >= tFar)
+				if (!GeometricPredicates::segmentCrossesTriangle(segmentStart,
+						segmentEnd, v0, v1, v2))
 					continue;
 #ifdef TAYLOR_SMOOTH_DEBUG_INTERSECT
 				if (i < TAYLOR_SMOOTH_DEBUG_DEPTH
@@ -447,15 +1907,19 @@ void TaylorKnotAlgorithm::smooth(unsigned int nRepeat = 1) {
 					printf(
 							"i#%d k#%d triangle {i;i';i+1} and line {j;j+1}(j>i)\nTRI{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)} line{(%.2f,%.2f,%.2f);(%.2f,%.2f,%.2f)}\n",
 							i, k, v0[0], v0[1], v0[2], v1[0], v1[1], v1[2],
-							v2[0], v2[1], v2[2], rayOrigin[0], rayOrigin[1],
-							rayOrigin[2], rayDirection[0], rayDirection[1],
-							rayDirection[2]);
+							v2[0], v2[1], v2[2], segmentStart[0], segmentStart[1],
+							segmentStart[2], segmentEnd[0], segmentEnd[1],
+							segmentEnd[2]);
 				}
 #endif
 				goto intersect;
 				break;
 			}
 			// both triangles don't intersect, commit vertex move
+			SUB3(d, v1p, v1a);
+			if (DOT(d, d) > TAYLOR_MOVE_EPSILON) {
+				nMoved++;
+			}
 			v1a[0] = v1p[0];
 			v1a[1] = v1p[1];
 			v1a[2] = v1p[2];
@@ -478,10 +1942,2750 @@ void TaylorKnotAlgorithm::smooth(unsigned int nRepeat = 1) {
 			nointersect: ;
 #endif
 		}
+		moving_ = nMoved;
+	}
+	return nMoved;
+}
+
+unsigned int TaylorKnotAlgorithm::smoothAuto(unsigned int maxRepeat) {
+	unsigned int nSweep = 0;
+	converged_ = false;
+	while (nSweep < maxRepeat) {
+		if (stopRequested()) {
+			interrupted_ = true;
+			break;
+		}
+		nSweep++;
+		if (smooth(1) == 0) {
+			converged_ = true;
+			break;
+		}
+	}
+	return nSweep;
+}
+
+/*
+ * Dropping the vertexes between kept.back() and b sweeps the chain over
+ * the fan of triangles {a,j,j+1}. The coarse chain keeps the same knot as
+ * long as no other segment of the current chain passes through the fan.
+ * The current chain is the coarse chain built so far followed by the
+ * original chain. Segments sharing a vertex with a triangle are skipped.
+ */
+bool TaylorKnotAlgorithm::fanUnobstructed(const float *x,
+		std::size_t nVertex, const std::vector<std::size_t> &kept,
+		std::size_t b) {
+	std::size_t a = kept.back();
+	const float *v0 = x + 3 * a;
+	for (std::size_t j = a + 1; j < b; j++) {
+		const float *v1 = x + 3 * j;
+		const float *v2 = v1 + 3;
+		// the last coarse segment ends at a
+		for (std::size_t c = 0; c + 2 < kept.size(); c++) {
+			if (GeometricPredicates::segmentCrossesTriangle(x + 3 * kept[c],
+					x + 3 * kept[c + 1], v0, v1, v2)) {
+				return false;
+			}
+		}
+		for (std::size_t k = j + 2; k + 1 < nVertex; k++) {
+			if (GeometricPredicates::segmentCrossesTriangle(x + 3 * k,
+					x + 3 * k + 3, v0, v1, v2)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool TaylorKnotAlgorithm::multiResolution(std::size_t residues,
+		bool extendTermini) {
+	return extendTermini && residues > TAYLOR_MULTIRES_LENGTH;
+}
+
+unsigned int TaylorKnotAlgorithm::smoothMultiResolution(unsigned int stride,
+		unsigned int maxRepeat) {
+	unsigned int nSweep;
+#ifdef TAYLOR_MULTIRES_CHECK
+	TaylorKnotAlgorithm reference;
+	std::unique_ptr<DoubleMatrix> copy = std::make_unique<DoubleMatrix>(m->s);
+	std::copy(m->m, m->m + m->n, copy->m);
+	reference.setMatrix(std::move(copy));
+	reference.smoothAuto(maxRepeat);
+#endif
+	nSweep = smoothLevel(stride, maxRepeat);
+#ifdef TAYLOR_MULTIRES_CHECK
+	if (reference.isKnotted() != isKnotted()) {
+		printf("Multi-resolution check failed: %zu vertexes, %u crossings "
+				"at full resolution, %u after refining\n", m->s,
+				reference.crossingCount(), crossingCount());
+	}
+#endif
+	return nSweep;
+}
+
+unsigned int TaylorKnotAlgorithm::smoothLevel(unsigned int stride,
+		unsigned int maxRepeat) {
+	std::size_t nVertex, a, b, step, iCoarse;
+	unsigned int nSweep;
+	std::vector<std::size_t> kept;
+	std::unique_ptr<DoubleMatrix> fine;
+	float *x, *A, *B;
+
+	nVertex = m->s;
+	if (stride < 2 || nVertex < TAYLOR_MULTIRES_MIN) {
+		return smoothAuto(maxRepeat);
+	}
+	/* build the coarse chain, falling back to a shorter step
+	 * whenever the skipped segment is obstructed
+	 */
+	x = m->m;
+	kept.push_back(0);
+	while (kept.back() < nVertex - 1) {
+		// each fan is checked against the whole chain, O(n^2) per level
+		// moving_ still counts the vertexes of the last sweep, if any
+		if (stopRequested()) {
+			interrupted_ = true;
+			converged_ = false;
+			return 0;
+		}
+		a = kept.back();
+		b = a + 1;
+		for (step = stride; step >= 2; step--) {
+			if (a + step >= nVertex) {
+				continue;
+			}
+			if (fanUnobstructed(x, nVertex, kept, a + step)) {
+				b = a + step;
+				break;
+			}
+		}
+		kept.push_back(b);
+	}
+	if (kept.size() == nVertex) {
+		return smoothAuto(maxRepeat);
+	}
+
+	fine = std::move(m);
+	m = std::make_unique<DoubleMatrix>(kept.size());
+	for (iCoarse = 0; iCoarse < kept.size(); iCoarse++) {
+		m->m[3 * iCoarse] = fine->m[3 * kept[iCoarse]];
+		m->m[3 * iCoarse + 1] = fine->m[3 * kept[iCoarse] + 1];
+		m->m[3 * iCoarse + 2] = fine->m[3 * kept[iCoarse] + 2];
+	}
+	// the coarse chain may itself be long enough for another level
+	nSweep = smoothLevel(stride, maxRepeat);
+
+	/* refine: the skipped vertexes are spread along the smoothed coarse
+	 * edges, which is the same curve so the knot is unchanged
+	 */
+	for (iCoarse = 0; iCoarse + 1 < kept.size(); iCoarse++) {
+		A = m->m + 3 * iCoarse;
+		B = A + 3;
+		a = kept[iCoarse];
+		b = kept[iCoarse + 1];
+		for (std::size_t i = a; i < b; i++) {
+			const float t = (float) (i - a) / (float) (b - a);
+			fine->m[3 * i] = A[0] + (B[0] - A[0]) * t;
+			fine->m[3 * i + 1] = A[1] + (B[1] - A[1]) * t;
+			fine->m[3 * i + 2] = A[2] + (B[2] - A[2]) * t;
+		}
+	}
+	m = std::move(fine);
+	if (interrupted_) {
+		/* the refined vertexes move with the coarse ones around them,
+		 * unless no coarse sweep ran and moving_ is still the last count
+		 */
+		if (nSweep > 0) {
+			moving_ = (unsigned int) ((std::uint64_t) moving_ * m->s
+					/ kept.size());
+		}
+		return nSweep;
+	}
+	// the refined vertexes have not been swept yet
+	moving_ = (unsigned int) m->s;
+	// the coarse levels used up part of the sweeps
+	return nSweep + smoothAuto(maxRepeat - nSweep);
+}
+
+bool TaylorKnotAlgorithm::isConverged() {
+	return converged_;
+}
+
+/* sign of the 2D orientation of c relative to the line {a;b} */
+#define ORIENT2D(a, b, c, ax, ay)\
+		(((double) b[ax] - a[ax]) * ((double) c[ay] - a[ay])\
+		- ((double) b[ay] - a[ay]) * ((double) c[ax] - a[ax]))
+unsigned int TaylorKnotAlgorithm::crossingCount() {
+	float *x = m->m;
+	float *p, *q, *r, *s;
+	unsigned int nCrossing, nMin;
+	int ax, ay;
+	nMin = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		ax = (axis + 1) % 3;
+		ay = (axis + 2) % 3;
+		nCrossing = 0;
+		for (std::size_t i = 0; i + 3 < m->n; i += 3) {
+			p = x + i;
+			q = p + 3;
+			// neighbouring segments share a vertex and never cross
+			for (std::size_t j = i + 6; j + 3 < m->n; j += 3) {
+				r = x + j;
+				s = r + 3;
+				if (ORIENT2D(p, q, r, ax, ay) * ORIENT2D(p, q, s, ax, ay) < 0.0
+						&& ORIENT2D(r, s, p, ax, ay) * ORIENT2D(r, s, q, ax, ay)
+								< 0.0) {
+					nCrossing++;
+				}
+			}
+		}
+		if (axis == 0 || nCrossing < nMin) {
+			nMin = nCrossing;
+		}
+	}
+	return nMin;
+}
+
+bool TaylorKnotAlgorithm::isKnotted() {
+	return crossingCount() >= TAYLOR_KNOT_MIN_CROSSINGS;
+}
+
+ProvisionalVerdict TaylorKnotAlgorithm::verdict() {
+	ProvisionalVerdict result;
+	result.crossings = crossingCount();
+	result.knotted = result.crossings >= TAYLOR_KNOT_MIN_CROSSINGS;
+	result.converged = converged_;
+	result.interrupted = interrupted_;
+	result.moving = converged_ ? 0 : moving_;
+	if (converged_ || m->s < 3) {
+		result.confidence = 1.0f;
+	} else {
+		result.confidence = 1.0f
+				- std::min(1.0f, (float) result.moving / (float) (m->s - 2));
+	}
+	return result;
+}
+
+KnotResult TaylorKnotAlgorithm::detect(
+		std::unique_ptr<DoubleMatrix> matrixPtr) {
+	KnotResult result;
+	setMatrix(std::move(matrixPtr));
+	result.residues = m->s;
+	if (extendTermini_) {
+		m = extendTermini(*m);
+	}
+	if (prescreen_) {
+		PrescreenResult screen = KnotPrescreen::screen(*m, result.residues);
+		if (screen.unknotted) {
+			converged_ = true;
+			result.sweeps = 0;
+			result.converged = true;
+			result.crossings = KNOT_CROSSINGS_UNKNOWN;
+			result.knotted = false;
+			result.prescreened = true;
+			return result;
+		}
+	}
+	result.prescreened = false;
+	if (multiResolution(result.residues, extendTermini_)) {
+		result.sweeps = smoothMultiResolution();
+	} else {
+		result.sweeps = smoothAuto();
+	}
+	result.converged = converged_;
+	result.crossings = crossingCount();
+	result.knotted = result.crossings >= TAYLOR_KNOT_MIN_CROSSINGS;
+	return result;
+}
+
+void TaylorKnotAlgorithm::setExtendTermini(bool extendTermini) {
+	extendTermini_ = extendTermini;
+}
+
+void TaylorKnotAlgorithm::setPrescreen(bool prescreen) {
+	prescreen_ = prescreen;
+}
+
+std::atomic<std::uint64_t> KnotPrescreen::screened_(0);
+std::atomic<std::uint64_t> KnotPrescreen::skipped_(0);
+
+// the axes, the body diagonals and the face diagonals of a cube
+#define PRESCREEN_DIRECTIONS 13
+// relative error below which a projected orientation is too close to call
+#define PRESCREEN_EPSILON 1e-12
+
+unsigned int KnotPrescreen::projectionCrossings(const float *x,
+		std::size_t nVertex, const double *direction, unsigned int limit,
+		Scratch &scratch) {
+	std::vector<double> &px = scratch.px, &py = scratch.py, &low = scratch.low,
+			&high = scratch.high;
+	std::vector<std::size_t> &order = scratch.order, &active = scratch.active;
+	double u[3], v[3], axis[3] = { 0.0, 0.0, 0.0 }, length;
+	unsigned int nCrossing = 0;
+	if (nVertex < 3) {
+		return 0;
+	}
+	// the capacity is kept, only a chain longer than any before allocates
+	px.resize(nVertex);
+	py.resize(nVertex);
+	low.resize(nVertex);
+	high.resize(nVertex);
+	order.clear();
+	active.clear();
+	// u and v span the plane normal to direction
+	int k = 0;
+	for (int i = 1; i < 3; i++) {
+		if (fabs(direction[i]) < fabs(direction[k])) {
+			k = i;
+		}
+	}
+	axis[k] = 1.0;
+	CROSS(u, direction, axis);
+	length = sqrt(DOT(u, u));
+	for (int i = 0; i < 3; i++) {
+		u[i] /= length;
+	}
+	CROSS(v, direction, u);
+	for (std::size_t i = 0; i < nVertex; i++) {
+		const float *p = x + 3 * i;
+		px[i] = u[0] * p[0] + u[1] * p[1] + u[2] * p[2];
+		py[i] = v[0] * p[0] + v[1] * p[1] + v[2] * p[2];
+	}
+	// sign of the orientation of c against {a;b}, 0 when too close to call
+	auto orient = [&px, &py](std::size_t a, std::size_t b, std::size_t c) {
+		const double left = (px[b] - px[a]) * (py[c] - py[a]);
+		const double right = (py[b] - py[a]) * (px[c] - px[a]);
+		const double det = left - right;
+		const double bound = PRESCREEN_EPSILON * (fabs(left) + fabs(right));
+		return (det > bound) - (det < -bound);
+	};
+	/* neighbouring segments only meet at their shared vertex, unless
+	 * the projection folds one back over the other
+	 */
+	for (std::size_t i = 0; i + 2 < nVertex; i++) {
+		if (orient(i, i + 1, i + 2) == 0
+				&& (px[i + 1] - px[i]) * (px[i + 2] - px[i + 1])
+						+ (py[i + 1] - py[i]) * (py[i + 2] - py[i + 1]) <= 0.0) {
+			if (++nCrossing >= limit) {
+				return nCrossing;
+			}
+		}
+	}
+	for (std::size_t i = 0; i + 1 < nVertex; i++) {
+		low[i] = std::min(px[i], px[i + 1]);
+		high[i] = std::max(px[i], px[i + 1]);
+		order.push_back(i);
+	}
+	std::sort(order.begin(), order.end(), [&low](std::size_t a, std::size_t b) {
+		return low[a] < low[b];
+	});
+	for (std::size_t a : order) {
+		// segments that end before this one starts are done
+		std::size_t kept = 0;
+		for (std::size_t b : active) {
+			if (high[b] >= low[a]) {
+				active[kept++] = b;
+			}
+		}
+		active.resize(kept);
+		const double yLow = std::min(py[a], py[a + 1]);
+		const double yHigh = std::max(py[a], py[a + 1]);
+		for (std::size_t b : active) {
+			if (b + 1 == a || a + 1 == b
+					|| std::max(py[b], py[b + 1]) < yLow
+					|| std::min(py[b], py[b + 1]) > yHigh) {
+				continue;
+			}
+			if (orient(a, a + 1, b) * orient(a, a + 1, b + 1) <= 0
+					&& orient(b, b + 1, a) * orient(b, b + 1, a + 1) <= 0) {
+				if (++nCrossing >= limit) {
+					return nCrossing;
+				}
+			}
+		}
+		active.push_back(a);
+	}
+	return nCrossing;
+}
+
+PrescreenResult KnotPrescreen::screen(const DoubleMatrix &trace,
+		std::size_t residues) {
+	static const double directions[PRESCREEN_DIRECTIONS][3] = { { 1, 0, 0 }, {
+			0, 1, 0 }, { 0, 0, 1 }, { 1, 1, 1 }, { 1, 1, -1 }, { 1, -1, 1 }, {
+			-1, 1, 1 }, { 1, 1, 0 }, { 1, -1, 0 }, { 1, 0, 1 }, { 1, 0, -1 }, {
+			0, 1, 1 }, { 0, 1, -1 } };
+	static thread_local Scratch scratch;
+	PrescreenResult result;
+	double center[3] = { 0.0, 0.0, 0.0 }, sum = 0.0, d[3], length;
+	unsigned int nCrossing;
+	// the added termini are split between both ends
+	const std::size_t first = (trace.s - std::min(residues, trace.s)) / 2;
+	const std::size_t last = first + std::min(residues, trace.s);
+	result.residues = residues;
+	result.radiusOfGyration = 0.0;
+	result.crossings = 0;
+	for (std::size_t i = first; i < last; i++) {
+		for (int k = 0; k < 3; k++) {
+			center[k] += trace.m[3 * i + k];
+		}
+	}
+	for (std::size_t i = first; i < last; i++) {
+		for (int k = 0; k < 3; k++) {
+			d[k] = trace.m[3 * i + k] - center[k] / (double) (last - first);
+		}
+		sum += DOT(d, d);
 	}
+	if (last > first) {
+		result.radiusOfGyration = sqrt(sum / (double) (last - first));
+	}
+	for (int p = 0; p < PRESCREEN_DIRECTIONS; p++) {
+		length = sqrt(DOT(directions[p], directions[p]));
+		for (int k = 0; k < 3; k++) {
+			d[k] = directions[p][k] / length;
+		}
+		// a projection can only matter while it beats the best so far
+		nCrossing = projectionCrossings(trace.m, trace.s, d,
+				p == 0 ? UINT_MAX : result.crossings, scratch);
+		if (p == 0 || nCrossing < result.crossings) {
+			result.crossings = nCrossing;
+		}
+		if (result.crossings == 0) {
+			break;
+		}
+	}
+	result.unknotted = trace.s < 6 || result.crossings == 0;
+	screened_.fetch_add(1, std::memory_order_relaxed);
+	if (result.unknotted) {
+		skipped_.fetch_add(1, std::memory_order_relaxed);
+	}
+	return result;
 }
-void TaylorKnotAlgorithm::smoothAuto() {
 
+std::uint64_t KnotPrescreen::screenedCount() {
+	return screened_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t KnotPrescreen::skippedCount() {
+	return skipped_.load(std::memory_order_relaxed);
+}
+
+std::uint64_t ConvexHull::edgeKey(std::size_t a, std::size_t b) {
+	return ((std::uint64_t) a << 32) | (std::uint64_t) b;
+}
+
+double ConvexHull::distance(const Face &face, const float *p) {
+	return face.normal[0] * p[0] + face.normal[1] * p[1]
+			+ face.normal[2] * p[2] - face.offset;
+}
+
+/* a, b and c are counterclockwise seen from outside */
+std::size_t ConvexHull::addFace(std::size_t a, std::size_t b, std::size_t c) {
+	Face face;
+	double u[3], v[3], length;
+	const float *A = x_ + 3 * a, *B = x_ + 3 * b, *C = x_ + 3 * c;
+	for (int i = 0; i < 3; i++) {
+		u[i] = (double) B[i] - A[i];
+		v[i] = (double) C[i] - A[i];
+	}
+	CROSS(face.normal, u, v);
+	length = sqrt(DOT(face.normal, face.normal));
+	if (length > 0.0) {
+		for (int i = 0; i < 3; i++) {
+			face.normal[i] /= length;
+		}
+	}
+	face.offset = face.normal[0] * A[0] + face.normal[1] * A[1]
+			+ face.normal[2] * A[2];
+	face.v[0] = a;
+	face.v[1] = b;
+	face.v[2] = c;
+	face.removed = false;
+	faces_.push_back(std::move(face));
+	edges_[edgeKey(a, b)] = faces_.size() - 1;
+	edges_[edgeKey(b, c)] = faces_.size() - 1;
+	edges_[edgeKey(c, a)] = faces_.size() - 1;
+	return faces_.size() - 1;
+}
+
+/* each point goes to the first candidate face it is above,
+ * points below all of them are inside the hull
+ */
+void ConvexHull::assign(const std::vector<std::size_t> &points,
+		const std::vector<std::size_t> &candidates) {
+	for (std::size_t point : points) {
+		for (std::size_t f : candidates) {
+			if (distance(faces_[f], x_ + 3 * point) > epsilon_) {
+				faces_[f].outside.push_back(point);
+				break;
+			}
+		}
+	}
+}
+
+int ConvexHull::build(const float *x, std::size_t n) {
+	std::size_t extreme[4] = { 0, 0, 0, 0 }, a, b, c, eye, iteration;
+	std::vector<std::size_t> points, created, visible, stack, visit;
+	std::vector<std::pair<std::size_t, std::size_t>> horizon;
+	std::vector<char> isVisible;
+	double best, d, length, scale = 0.0, u[3], v[3], w[3];
+	double normal[3] = { 0.0, 0.0, 0.0 };
+	x_ = x;
+	faces_.clear();
+	edges_.clear();
+	if (n < 4) {
+		return 1;
+	}
+	for (std::size_t i = 0; i < 3 * n; i++) {
+		scale = std::max(scale, (double) fabs(x[i]));
+	}
+	epsilon_ = 1e-9 * std::max(scale, 1.0);
+
+	/* initial tetrahedron: the extreme points along x, the point farthest
+	 * from their line and the point farthest from the plane of the three
+	 */
+	for (std::size_t i = 1; i < n; i++) {
+		if (x[3 * i] < x[3 * extreme[0]]) {
+			extreme[0] = i;
+		}
+		if (x[3 * i] > x[3 * extreme[1]]) {
+			extreme[1] = i;
+		}
+	}
+	best = 0.0;
+	for (int k = 0; k < 3; k++) {
+		u[k] = (double) x[3 * extreme[1] + k] - x[3 * extreme[0] + k];
+	}
+	for (std::size_t i = 0; i < n; i++) {
+		for (int k = 0; k < 3; k++) {
+			v[k] = (double) x[3 * i + k] - x[3 * extreme[0] + k];
+		}
+		CROSS(w, u, v);
+		d = DOT(w, w);
+		if (d > best) {
+			best = d;
+			extreme[2] = i;
+			normal[0] = w[0];
+			normal[1] = w[1];
+			normal[2] = w[2];
+		}
+	}
+	length = sqrt(best);
+	if (length <= epsilon_ * std::max(sqrt(DOT(u, u)), 1.0)) {
+		return 1;
+	}
+	best = 0.0;
+	for (std::size_t i = 0; i < n; i++) {
+		for (int k = 0; k < 3; k++) {
+			v[k] = (double) x[3 * i + k] - x[3 * extreme[0] + k];
+		}
+		d = DOT(normal, v) / length;
+		if (fabs(d) > fabs(best)) {
+			best = d;
+			extreme[3] = i;
+		}
+	}
+	if (fabs(best) <= epsilon_) {
+		return 1;
+	}
+	// the base has to face away from the apex
+	a = extreme[0];
+	b = best > 0.0 ? extreme[2] : extreme[1];
+	c = best > 0.0 ? extreme[1] : extreme[2];
+	created.push_back(addFace(a, b, c));
+	created.push_back(addFace(a, extreme[3], b));
+	created.push_back(addFace(b, extreme[3], c));
+	created.push_back(addFace(c, extreme[3], a));
+	for (std::size_t i = 0; i < n; i++) {
+		if (i != extreme[0] && i != extreme[1] && i != extreme[2]
+				&& i != extreme[3]) {
+			points.push_back(i);
+		}
+	}
+	assign(points, created);
+
+	/* faces are only appended, so one pass over the list reaches every
+	 * face that still has points above it
+	 */
+	for (std::size_t f = 0; f < faces_.size(); f++) {
+		if (faces_[f].removed || faces_[f].outside.empty()) {
+			continue;
+		}
+		eye = faces_[f].outside[0];
+		best = 0.0;
+		for (std::size_t point : faces_[f].outside) {
+			d = distance(faces_[f], x_ + 3 * point);
+			if (d > best) {
+				best = d;
+				eye = point;
+			}
+		}
+		// faces seen from the eye point, bounded by the horizon edges
+		iteration = f + 1;
+		visit.resize(faces_.size(), 0);
+		isVisible.resize(faces_.size(), 0);
+		visible.assign(1, f);
+		stack.assign(1, f);
+		horizon.clear();
+		visit[f] = iteration;
+		isVisible[f] = 1;
+		while (!stack.empty()) {
+			std::size_t g = stack.back();
+			stack.pop_back();
+			for (int k = 0; k < 3; k++) {
+				a = faces_[g].v[k];
+				b = faces_[g].v[(k + 1) % 3];
+				auto across = edges_.find(edgeKey(b, a));
+				if (across == edges_.end()) {
+					continue;
+				}
+				std::size_t h = across->second;
+				if (visit[h] != iteration) {
+					visit[h] = iteration;
+					isVisible[h] = distance(faces_[h], x_ + 3 * eye) > epsilon_;
+					if (isVisible[h]) {
+						visible.push_back(h);
+						stack.push_back(h);
+					}
+				}
+				if (!isVisible[h]) {
+					horizon.push_back(std::make_pair(a, b));
+				}
+			}
+		}
+		points.clear();
+		for (std::size_t g : visible) {
+			for (std::size_t point : faces_[g].outside) {
+				if (point != eye) {
+					points.push_back(point);
+				}
+			}
+			faces_[g].outside.clear();
+			faces_[g].outside.shrink_to_fit();
+			faces_[g].removed = true;
+			for (int k = 0; k < 3; k++) {
+				edges_.erase(edgeKey(faces_[g].v[k], faces_[g].v[(k + 1) % 3]));
+			}
+		}
+		created.clear();
+		for (const std::pair<std::size_t, std::size_t> &edge : horizon) {
+			created.push_back(addFace(edge.first, edge.second, eye));
+		}
+		assign(points, created);
+	}
+	return 0;
+}
+
+std::size_t ConvexHull::faceCount() {
+	std::size_t count = 0;
+	for (const Face &face : faces_) {
+		count += !face.removed;
+	}
+	return count;
+}
+
+double ConvexHull::exitDistance(const float *p, const double *d) {
+	double exit = -1.0, along, s;
+	for (const Face &face : faces_) {
+		if (face.removed) {
+			continue;
+		}
+		along = DOT(face.normal, d);
+		if (along <= 0.0) {
+			continue;
+		}
+		s = -distance(face, p) / along;
+		if (exit < 0.0 || s < exit) {
+			exit = s;
+		}
+	}
+	return std::max(exit, 0.0);
+}
+
+/*
+ * Taylor's closure: each terminus is moved out along the line from the
+ * centre of the chain until it is well clear of the protein, so the ends
+ * can't be pulled back through the chain while it is smoothed.
+ */
+std::unique_ptr<DoubleMatrix> TaylorKnotAlgorithm::extendTermini(
+		const DoubleMatrix &trace) {
+	ConvexHull hull;
+	const std::size_t s = trace.s;
+	double center[3] = { 0.0, 0.0, 0.0 }, radius = 0.0, d[3], length, exit;
+	std::unique_ptr<DoubleMatrix> extended;
+	if (s < 2) {
+		extended = std::make_unique<DoubleMatrix>(s);
+		std::copy(trace.m, trace.m + trace.n, extended->m);
+		return extended;
+	}
+	extended = std::make_unique<DoubleMatrix>(s + 2);
+	std::copy(trace.m, trace.m + trace.n, extended->m + 3);
+	for (std::size_t i = 0; i < s; i++) {
+		for (int k = 0; k < 3; k++) {
+			center[k] += trace.m[3 * i + k];
+		}
+	}
+	for (int k = 0; k < 3; k++) {
+		center[k] /= (double) s;
+	}
+	for (std::size_t i = 0; i < s; i++) {
+		for (int k = 0; k < 3; k++) {
+			d[k] = trace.m[3 * i + k] - center[k];
+		}
+		radius = std::max(radius, sqrt(DOT(d, d)));
+	}
+	// a flat chain has no hull, its bounding sphere is used instead
+	const bool hasHull = hull.build(trace.m, s) == 0;
+	for (int end = 0; end < 2; end++) {
+		const float *t = trace.m + (end ? 3 * (s - 1) : 0);
+		const float *next = trace.m + (end ? 3 * (s - 2) : 3);
+		float *out = extended->m + (end ? 3 * (s + 1) : 0);
+		for (int k = 0; k < 3; k++) {
+			d[k] = t[k] - center[k];
+		}
+		length = sqrt(DOT(d, d));
+		// a terminus at the centre leaves along its last segment
+		if (length <= 1e-6 * std::max(radius, 1.0)) {
+			for (int k = 0; k < 3; k++) {
+				d[k] = (double) t[k] - next[k];
+			}
+			length = sqrt(DOT(d, d));
+		}
+		if (length == 0.0) {
+			d[0] = 1.0;
+			d[1] = d[2] = 0.0;
+			length = 1.0;
+		}
+		for (int k = 0; k < 3; k++) {
+			d[k] /= length;
+		}
+		exit = hasHull ? hull.exitDistance(t, d) : radius + length;
+		for (int k = 0; k < 3; k++) {
+			out[k] = (float) (center[k]
+					+ TAYLOR_EXTENSION_FACTOR * (t[k] + exit * d[k] - center[k]));
+		}
+	}
+	return extended;
+}
+
+CarbonAlphaMatrixWriter::CarbonAlphaMatrixWriter() {
+	file_ = nullptr;
+	format_ = PDB;
+	multiModel_ = false;
+	conect_ = false;
+	frameCount_ = 0;
+	atomCount_ = 0;
+}
+CarbonAlphaMatrixWriter::~CarbonAlphaMatrixWriter() {
+	close();
+}
+
+/*
+ * PDB records are padded to 80 columns the same way MMDB does
+ */
+void CarbonAlphaMatrixWriter::appendLine(const char *line) {
+	std::size_t length = strlen(line);
+	buffer_.append(line, length);
+	if (format_ == PDB && length < 80) {
+		buffer_.append(80 - length, ' ');
+	}
+	buffer_.push_back('\n');
+}
+
+int CarbonAlphaMatrixWriter::open(const char *path, Format format,
+		bool multiModel) {
+	close();
+	file_ = fopen(path, "w");
+	if (!file_) {
+		printf("Error opening output file: %s\n", path);
+		return 1;
+	}
+	format_ = format;
+	multiModel_ = multiModel;
+	frameCount_ = 0;
+	atomCount_ = 0;
+	buffer_.clear();
+	if (format_ == PDB) {
+		appendLine("COMPND    UNNAMED");
+		appendLine("AUTHOR    GENERATED BY PROTEIN KNOT DETECTOR 1.00");
+	} else {
+		appendLine("data_UNNAMED");
+		appendLine("#");
+		appendLine("loop_");
+		appendLine("_atom_site.group_PDB");
+		appendLine("_atom_site.id");
+		appendLine("_atom_site.type_symbol");
+		appendLine("_atom_site.label_atom_id");
+		appendLine("_atom_site.label_comp_id");
+		appendLine("_atom_site.label_asym_id");
+		appendLine("_atom_site.label_seq_id");
+		appendLine("_atom_site.Cartn_x");
+		appendLine("_atom_site.Cartn_y");
+		appendLine("_atom_site.Cartn_z");
+		appendLine("_atom_site.occupancy");
+		appendLine("_atom_site.B_iso_or_equiv");
+		appendLine("_atom_site.pdbx_PDB_model_num");
+	}
+	fwrite(buffer_.data(), 1, buffer_.size(), file_);
+	return 0;
+}
+
+void CarbonAlphaMatrixWriter::setConect(bool conect) {
+	conect_ = conect;
+}
+
+const std::string& CarbonAlphaMatrixWriter::formatFrame(
+		const DoubleMatrix &matrix) {
+	char line[128];
+	int iResidue;
+	frameCount_++;
+	// clear() keeps the capacity so only the first frame allocates
+	buffer_.clear();
+	buffer_.reserve(matrix.s * 81 + 256);
+	if (format_ == PDB && multiModel_) {
+		snprintf(line, sizeof(line), "MODEL     %4d", frameCount_);
+		appendLine(line);
+	}
+	iResidue = 1;
+	for (std::size_t i = 0; i < matrix.n; i += 3) {
+		if (format_ == PDB) {
+			/* same columns as the MMDB atom record:
+			 * serial, name, altLoc, resName, chainID, resSeq, iCode,
+			 * x, y, z, occupancy, tempFactor, segID, element, charge
+			 */
+			snprintf(line, sizeof(line),
+					"ATOM  %5d %-4s%c%-3s%2s%4d%c   %8.3f%8.3f%8.3f%6.2f%6.2f      %-4s%2s%2s",
+					iResidue, " CA ", ' ', "ALA", "A", iResidue, ' ',
+					(double) matrix.m[i], (double) matrix.m[i + 1],
+					(double) matrix.m[i + 2], 1.0, 1.0, "", "C", "");
+		} else {
+			snprintf(line, sizeof(line),
+					"ATOM %d C CA ALA A %d %.3f %.3f %.3f 1.00 1.00 %d",
+					iResidue, iResidue, (double) matrix.m[i],
+					(double) matrix.m[i + 1], (double) matrix.m[i + 2],
+					frameCount_);
+		}
+		appendLine(line);
+		iResidue++;
+	}
+	atomCount_ = (int) matrix.s;
+	if (format_ == PDB && multiModel_) {
+		appendLine("ENDMDL");
+	}
+	return buffer_;
+}
+
+int CarbonAlphaMatrixWriter::writeFrame(const DoubleMatrix &matrix) {
+	if (!file_) {
+		return 1;
+	}
+	formatFrame(matrix);
+	if (fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size()) {
+		printf("Error writing frame #%d\n", frameCount_);
+		return 2;
+	}
+	return 0;
+}
+
+int CarbonAlphaMatrixWriter::close() {
+	char line[128];
+	int RC = 0;
+	if (file_) {
+		buffer_.clear();
+		if (format_ == PDB) {
+			/* CONECT records follow the last model,
+			 * every frame shares the same chain
+			 */
+			for (int i = 1; conect_ && atomCount_ > 1 && i <= atomCount_;
+					i++) {
+				if (i == 1) {
+					snprintf(line, sizeof(line), "CONECT%5d%5d", i, i + 1);
+				} else if (i == atomCount_) {
+					snprintf(line, sizeof(line), "CONECT%5d%5d", i, i - 1);
+				} else {
+					snprintf(line, sizeof(line), "CONECT%5d%5d%5d", i, i - 1,
+							i + 1);
+				}
+				appendLine(line);
+			}
+			appendLine("END");
+		} else {
+			appendLine("#");
+		}
+		fwrite(buffer_.data(), 1, buffer_.size(), file_);
+		RC = fclose(file_);
+		file_ = nullptr;
+	}
+	return RC;
+}
+
+CIFCarbonAlphaStream::CIFCarbonAlphaStream() {
+	traceModel_ = 0;
+	firstModelOnly_ = false;
+	chainCount_ = 0;
+}
+
+void CIFCarbonAlphaStream::setFirstModelOnly(bool firstModelOnly) {
+	firstModelOnly_ = firstModelOnly;
+}
+
+std::size_t CIFCarbonAlphaStream::chainCount() {
+	return chainCount_;
+}
+
+int CIFCarbonAlphaStream::findTag(const char *name) {
+	for (std::size_t i = 0; i < tags_.size(); i++) {
+		if (tags_[i] == name) {
+			return (int) i;
+		}
+	}
+	return -1;
+}
+
+/* label_atom_id is the standard atom name and auth_asym_id the chain
+ * identifier that MMDB and the PDB format use
+ */
+bool CIFCarbonAlphaStream::mapColumns() {
+	const char *names[N_COLUMN][2] = { { "_atom_site.label_atom_id",
+			"_atom_site.auth_atom_id" }, { "_atom_site.label_alt_id", "" }, {
+			"_atom_site.type_symbol", "" }, { "_atom_site.auth_asym_id",
+			"_atom_site.label_asym_id" }, { "_atom_site.pdbx_PDB_model_num",
+			"" }, { "_atom_site.Cartn_x", "" }, { "_atom_site.Cartn_y", "" }, {
+			"_atom_site.Cartn_z", "" } };
+	tagColumn_.assign(tags_.size(), -1);
+	for (int c = 0; c < N_COLUMN; c++) {
+		int tag = findTag(names[c][0]);
+		if (tag < 0 && names[c][1][0]) {
+			tag = findTag(names[c][1]);
+		}
+		if (tag >= 0) {
+			tagColumn_[tag] = c;
+		}
+		value_[c].clear();
+	}
+	return findTag(names[ATOM_ID][0]) >= 0 || findTag(names[ATOM_ID][1]) >= 0;
+}
+
+void CIFCarbonAlphaStream::flush(const ChainCallback &callback) {
+	ChainTrace trace;
+	if (trace_.empty()) {
+		return;
+	}
+	trace.modelId = traceModel_;
+	trace.chainId = traceChain_;
+	trace.matrix = std::make_unique<DoubleMatrix>(trace_.size() / 3);
+	std::copy(trace_.begin(), trace_.end(), trace.matrix->m);
+	// clear() keeps the capacity for the next chain
+	trace_.clear();
+	chainCount_++;
+	callback(std::move(trace));
+}
+
+/* returns false once the rest of the file is not needed */
+bool CIFCarbonAlphaStream::addRow(const ChainCallback &callback) {
+	int model;
+	if (value_[ATOM_ID] != "CA") {
+		return true;
+	}
+	// a calcium ion is also named CA
+	if (!value_[TYPE_SYMBOL].empty() && value_[TYPE_SYMBOL] != "C") {
+		return true;
+	}
+	if (!value_[ALT_ID].empty() && value_[ALT_ID] != "."
+			&& value_[ALT_ID] != "?" && value_[ALT_ID] != "A") {
+		return true;
+	}
+	model = value_[MODEL_NUM].empty() ? 1 : atoi(value_[MODEL_NUM].c_str());
+	if (model != traceModel_ || value_[ASYM_ID] != traceChain_) {
+		if (firstModelOnly_ && traceModel_ != 0 && model != traceModel_) {
+			return false;
+		}
+		flush(callback);
+		traceModel_ = model;
+		traceChain_ = value_[ASYM_ID];
+	}
+	trace_.push_back(strtof(value_[CARTN_X].c_str(), nullptr));
+	trace_.push_back(strtof(value_[CARTN_Y].c_str(), nullptr));
+	trace_.push_back(strtof(value_[CARTN_Z].c_str(), nullptr));
+	return true;
+}
+
+int CIFCarbonAlphaStream::read(const char *path,
+		const ChainCallback &callback) {
+	enum {
+		SEEK_LOOP, READ_TAGS, READ_ROWS
+	} state = SEEK_LOOP;
+	std::size_t iToken = 0, start, end;
+	bool found = false, more = true;
+	std::ifstream file(path);
+	if (!file) {
+		return 1;
+	}
+	chainCount_ = 0;
+	trace_.clear();
+	traceModel_ = 0;
+	traceChain_.clear();
+	while (more && std::getline(file, line_)) {
+		if (!line_.empty() && line_.back() == '\r') {
+			line_.pop_back();
+		}
+		if (state == SEEK_LOOP) {
+			if (line_.compare(0, 5, "loop_") == 0) {
+				tags_.clear();
+				state = READ_TAGS;
+			}
+			continue;
+		}
+		if (state == READ_TAGS) {
+			if (line_.compare(0, 11, "_atom_site.") == 0) {
+				end = line_.find_first_of(" \t");
+				tags_.push_back(line_.substr(0, end));
+				continue;
+			}
+			if (tags_.empty() || !mapColumns()) {
+				state = line_.compare(0, 5, "loop_") == 0 ? READ_TAGS : SEEK_LOOP;
+				tags_.clear();
+				continue;
+			}
+			found = true;
+			iToken = 0;
+			state = READ_ROWS;
+		}
+		// READ_ROWS, the loop ends at the next item, loop or data block
+		if (line_.empty()) {
+			continue;
+		}
+		if (line_[0] == '#' || line_[0] == '_'
+				|| line_.compare(0, 5, "loop_") == 0
+				|| line_.compare(0, 5, "data_") == 0) {
+			flush(callback);
+			state = line_.compare(0, 5, "loop_") == 0 ? READ_TAGS : SEEK_LOOP;
+			tags_.clear();
+			continue;
+		}
+		/* a row may continue on the next line, tokens are counted
+		 * across lines until every tag has its value
+		 */
+		start = 0;
+		while (more) {
+			start = line_.find_first_not_of(" \t", start);
+			if (start == std::string::npos) {
+				break;
+			}
+			if (line_[start] == '\'' || line_[start] == '"') {
+				// a quote only closes when followed by white space
+				for (end = start + 1;; end++) {
+					end = line_.find(line_[start], end);
+					if (end == std::string::npos) {
+						end = line_.size();
+						break;
+					}
+					if (end + 1 == line_.size() || line_[end + 1] == ' '
+							|| line_[end + 1] == '\t') {
+						break;
+					}
+				}
+				if (tagColumn_[iToken] >= 0) {
+					value_[tagColumn_[iToken]].assign(line_, start + 1,
+							end - start - 1);
+				}
+				end = std::min(end + 1, line_.size());
+			} else {
+				end = line_.find_first_of(" \t", start);
+				if (end == std::string::npos) {
+					end = line_.size();
+				}
+				if (tagColumn_[iToken] >= 0) {
+					value_[tagColumn_[iToken]].assign(line_, start,
+							end - start);
+				}
+			}
+			start = end;
+			if (++iToken == tags_.size()) {
+				iToken = 0;
+				more = addRow(callback);
+			}
+		}
+	}
+	flush(callback);
+	return found ? 0 : 2;
+}
+
+template<typename Job>
+WorkerPool<Job>::WorkerPool(unsigned int nThreads, std::size_t capacity,
+		Worker worker) {
+	capacity_ = std::max<std::size_t>(capacity, 1);
+	closed_ = false;
+	worker_ = worker;
+	for (unsigned int i = 0; i < std::max(nThreads, 1u); i++) {
+		threads_.emplace_back(&WorkerPool::run, this);
+	}
+}
+
+template<typename Job>
+WorkerPool<Job>::~WorkerPool() {
+	finish();
+}
+
+template<typename Job>
+void WorkerPool<Job>::run() {
+	for (;;) {
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			notEmpty_.wait(lock, [this] {
+				return closed_ || !queue_.empty();
+			});
+			if (queue_.empty()) {
+				return;
+			}
+			job = std::move(queue_.front());
+			queue_.pop_front();
+		}
+		notFull_.notify_one();
+		worker_(job);
+	}
+}
+
+template<typename Job>
+void WorkerPool<Job>::push(Job job) {
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		notFull_.wait(lock, [this] {
+			return queue_.size() < capacity_;
+		});
+		queue_.push_back(std::move(job));
+	}
+	notEmpty_.notify_one();
+}
+
+template<typename Job>
+void WorkerPool<Job>::finish() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closed_ = true;
+	}
+	notEmpty_.notify_all();
+	for (std::thread &thread : threads_) {
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+	threads_.clear();
+}
+
+// Rigid body invariants are rounded to this many Angstrom for the key
+#define KNOT_CACHE_QUANTUM 0.1
+// Largest RMSD in Angstrom at which two traces share one verdict
+#define KNOT_CACHE_RMSD 0.01
+
+KnotResultCache::KnotResultCache() {
+	finishedBytes_ = 0;
+	hitCount_ = 0;
+	diskHitCount_ = 0;
+	computeCount_ = 0;
+}
+
+void KnotResultCache::setDirectory(const std::string &directory) {
+	std::error_code ec;
+	std::lock_guard<std::mutex> lock(mutex_);
+	directory_ = directory;
+	if (!directory_.empty()) {
+		std::filesystem::create_directories(directory_, ec);
+	}
+}
+
+/* cyclic Jacobi rotations on the symmetric n x n matrix a (n <= 4),
+ * a is destroyed and the eigenvalues are left in any order
+ */
+void KnotResultCache::jacobiEigenvalues(double *a, int n, double *eigenvalues) {
+	double norm = 0.0;
+	for (int i = 0; i < n * n; i++) {
+		norm += a[i] * a[i];
+	}
+	for (int sweep = 0; sweep < 50; sweep++) {
+		double offDiagonal = 0.0;
+		for (int p = 0; p < n; p++) {
+			for (int q = p + 1; q < n; q++) {
+				offDiagonal += a[p * n + q] * a[p * n + q];
+			}
+		}
+		if (offDiagonal <= 1e-30 * norm) {
+			break;
+		}
+		for (int p = 0; p < n; p++) {
+			for (int q = p + 1; q < n; q++) {
+				if (a[p * n + q] == 0.0) {
+					continue;
+				}
+				const double theta = (a[q * n + q] - a[p * n + p])
+						/ (2.0 * a[p * n + q]);
+				const double t = (theta >= 0.0 ? 1.0 : -1.0)
+						/ (fabs(theta) + sqrt(theta * theta + 1.0));
+				const double c = 1.0 / sqrt(t * t + 1.0);
+				const double s = t * c;
+				for (int k = 0; k < n; k++) {
+					const double akp = a[k * n + p];
+					const double akq = a[k * n + q];
+					a[k * n + p] = c * akp - s * akq;
+					a[k * n + q] = s * akp + c * akq;
+				}
+				for (int k = 0; k < n; k++) {
+					const double apk = a[p * n + k];
+					const double aqk = a[q * n + k];
+					a[p * n + k] = c * apk - s * aqk;
+					a[q * n + k] = s * apk + c * aqk;
+				}
+			}
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		eigenvalues[i] = a[i * n + i];
+	}
+}
+
+/* FNV-1a over the parameters, the residue count and the rounded
+ * invariants of the centred trace
+ */
+std::uint64_t KnotResultCache::key(const std::vector<float> &trace,
+		const std::string &parameters) {
+	std::uint64_t hash = 14695981039346656037ULL;
+	auto mix = [&hash](const void *data, std::size_t size) {
+		const unsigned char *byte = (const unsigned char*) data;
+		for (std::size_t i = 0; i < size; i++) {
+			hash = (hash ^ byte[i]) * 1099511628211ULL;
+		}
+	};
+	double covariance[9] = { }, moments[3], d[3];
+	long long rounded[4];
+	const std::size_t nResidue = trace.size() / 3;
+	for (std::size_t i = 0; i < trace.size(); i += 3) {
+		for (int r = 0; r < 3; r++) {
+			for (int c = 0; c < 3; c++) {
+				covariance[3 * r + c] += (double) trace[i + r] * trace[i + c];
+			}
+		}
+	}
+	jacobiEigenvalues(covariance, 3, moments);
+	std::sort(moments, moments + 3);
+	for (int i = 0; i < 3; i++) {
+		rounded[i] = llround(
+				sqrt(std::max(moments[i], 0.0) / std::max<std::size_t>(nResidue, 1))
+						/ KNOT_CACHE_QUANTUM);
+		d[i] = nResidue ? (double) trace[trace.size() - 3 + i] - trace[i] : 0.0;
+	}
+	rounded[3] = llround(sqrt(DOT(d, d)) / KNOT_CACHE_QUANTUM);
+	mix(parameters.data(), parameters.size());
+	mix(&nResidue, sizeof(nResidue));
+	mix(rounded, sizeof(rounded));
+	return hash;
+}
+
+/* Least RMSD of two centred traces over all rotations, from the largest
+ * eigenvalue of Horn's quaternion matrix
+ */
+double KnotResultCache::rmsd(const std::vector<float> &a,
+		const std::vector<float> &b) {
+	double S[9] = { }, K[16], eigenvalues[4], G = 0.0;
+	const std::size_t nResidue = a.size() / 3;
+	if (nResidue == 0 || a.size() != b.size()) {
+		return nResidue == 0 && a.size() == b.size() ? 0.0 : HUGE_VAL;
+	}
+	for (std::size_t i = 0; i < a.size(); i += 3) {
+		for (int r = 0; r < 3; r++) {
+			G += (double) a[i + r] * a[i + r] + (double) b[i + r] * b[i + r];
+			for (int c = 0; c < 3; c++) {
+				S[3 * r + c] += (double) a[i + r] * b[i + c];
+			}
+		}
+	}
+	const double Sxx = S[0], Sxy = S[1], Sxz = S[2], Syx = S[3], Syy = S[4],
+			Syz = S[5], Szx = S[6], Szy = S[7], Szz = S[8];
+	const double matrix[16] = { Sxx + Syy + Szz, Syz - Szy, Szx - Sxz, Sxy
+			- Syx, Syz - Szy, Sxx - Syy - Szz, Sxy + Syx, Szx + Sxz, Szx - Sxz,
+			Sxy + Syx, -Sxx + Syy - Szz, Syz + Szy, Sxy - Syx, Szx + Sxz, Syz
+					+ Szy, -Sxx - Syy + Szz };
+	std::copy(matrix, matrix + 16, K);
+	jacobiEigenvalues(K, 4, eigenvalues);
+	const double lambda = *std::max_element(eigenvalues, eigenvalues + 4);
+	return sqrt(std::max(G - 2.0 * lambda, 0.0) / nResidue);
+}
+
+std::string KnotResultCache::fileName(std::uint64_t key) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.pkd", (unsigned long long) key);
+	return (std::filesystem::path(directory_) / name).string();
+}
+
+/* A cache file holds one record per chain that shares the key:
+ *   parameters <text>
+ *   residues N knotted 0|1 converged 0|1 sweeps N prescreened 0|1
+ *   followed by N lines of centred coordinates
+ * A record cut short by a killed process is skipped.
+ */
+bool KnotResultCache::load(const Entry &entry, KnotResult &result) {
+	std::string line;
+	std::vector<float> trace;
+	KnotResult record;
+	int knotted, converged, prescreened;
+	bool pending = false, complete;
+	std::ifstream file(fileName(entry.key));
+	while (pending || std::getline(file, line)) {
+		pending = false;
+		if (line.compare(0, 11, "parameters ") != 0) {
+			continue;
+		}
+		const bool sameParameters = line.compare(11, std::string::npos,
+				entry.parameters) == 0;
+		if (!std::getline(file, line)) {
+			return false;
+		}
+		// the line is looked at again in case it starts the next record
+		prescreened = 0;
+		if (sscanf(line.c_str(),
+				"residues %zu knotted %d converged %d sweeps %u prescreened %d",
+				&record.residues, &knotted, &converged, &record.sweeps,
+				&prescreened) < 4) {
+			pending = true;
+			continue;
+		}
+		trace.resize(3 * record.residues);
+		complete = true;
+		for (std::size_t i = 0; i < trace.size(); i += 3) {
+			if (!std::getline(file, line)) {
+				return false;
+			}
+			if (sscanf(line.c_str(), "%f %f %f", &trace[i], &trace[i + 1],
+					&trace[i + 2]) != 3) {
+				pending = true;
+				complete = false;
+				break;
+			}
+		}
+		if (complete && sameParameters
+				&& rmsd(trace, entry.trace) <= KNOT_CACHE_RMSD) {
+			record.knotted = knotted != 0;
+			record.converged = converged != 0;
+			record.prescreened = prescreened != 0;
+			record.crossings = KNOT_CROSSINGS_UNKNOWN;
+			result = record;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* The record is formatted first and appended with a single write(2) on an
+ * O_APPEND descriptor, so on a local file system records of other
+ * processes are never copied or interleaved. Threads of this process
+ * writing the same key take turns. Elsewhere the stdio buffer is made as
+ * large as the record, which is flushed in one write when the file closes.
+ */
+int KnotResultCache::store(const Entry &entry, const KnotResult &result) {
+	std::string record;
+	char line[128];
+	snprintf(line, sizeof(line),
+			"residues %zu knotted %d converged %d sweeps %u prescreened %d\n",
+			result.residues, (int) result.knotted, (int) result.converged,
+			result.sweeps, (int) result.prescreened);
+	// the blank line ends a record that a killed process left unfinished
+	record.append("\nparameters ").append(entry.parameters).append("\n").append(
+			line);
+	for (std::size_t i = 0; i < entry.trace.size(); i += 3) {
+		snprintf(line, sizeof(line), "%.3f %.3f %.3f\n", entry.trace[i],
+				entry.trace[i + 1], entry.trace[i + 2]);
+		record.append(line);
+	}
+	std::lock_guard<std::mutex> lock(
+			fileMutex_[entry.key % KNOT_CACHE_FILE_LOCKS]);
+#ifdef __linux__
+	int fd = open(fileName(entry.key).c_str(),
+			O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return 1;
+	}
+	// a short write leaves a cut record, which load() skips
+	const ssize_t written = write(fd, record.data(), record.size());
+	if (close(fd) != 0 || written != (ssize_t) record.size()) {
+		return 2;
+	}
+#else
+	std::vector<char> buffer(record.size() + 1);
+	FILE *file = fopen(fileName(entry.key).c_str(), "ab");
+	if (file == nullptr) {
+		return 1;
+	}
+	// with a null buffer the size is ignored and the default one is kept
+	setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+	const std::size_t written = fwrite(record.data(), 1, record.size(), file);
+	if (fclose(file) != 0 || written != record.size()) {
+		return 2;
+	}
+#endif
+	return 0;
+}
+
+void KnotResultCache::retire(Entry &entry) {
+	auto range = inFlight_.equal_range(entry.key);
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == &entry) {
+			inFlight_.erase(it);
+			break;
+		}
+	}
+	finishedBytes_ += entry.trace.size() * sizeof(float);
+	finished_.push_front(std::move(entry));
+	finishedIndex_.emplace(finished_.front().key, finished_.begin());
+	while (finishedBytes_ > KNOT_CACHE_MEMORY_BYTES && finished_.size() > 1) {
+		std::list<Entry>::iterator last = std::prev(finished_.end());
+		auto indexed = finishedIndex_.equal_range(last->key);
+		for (auto it = indexed.first; it != indexed.second; ++it) {
+			if (it->second == last) {
+				finishedIndex_.erase(it);
+				break;
+			}
+		}
+		finishedBytes_ -= last->trace.size() * sizeof(float);
+		finished_.erase(last);
+	}
+}
+
+KnotResult KnotResultCache::lookup(const DoubleMatrix &matrix,
+		const std::string &parameters, const Compute &compute, bool *cached) {
+	Entry entry;
+	double centroid[3] = { };
+	std::promise<KnotResult> promise;
+	std::shared_future<KnotResult> future;
+	KnotResult result;
+	bool fromDisk;
+
+	entry.parameters = parameters;
+	entry.trace.assign(matrix.m, matrix.m + matrix.n);
+	for (std::size_t i = 0; i < matrix.n; i += 3) {
+		centroid[0] += matrix.m[i];
+		centroid[1] += matrix.m[i + 1];
+		centroid[2] += matrix.m[i + 2];
+	}
+	for (std::size_t i = 0; i < matrix.n; i++) {
+		entry.trace[i] -= (float) (centroid[i % 3] / std::max<std::size_t>(matrix.s, 1));
+	}
+	entry.key = key(entry.trace, parameters);
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		auto running = inFlight_.equal_range(entry.key);
+		for (auto it = running.first; it != running.second; ++it) {
+			if (it->second->parameters == parameters
+					&& rmsd(it->second->trace, entry.trace) <= KNOT_CACHE_RMSD) {
+				future = it->second->result;
+				break;
+			}
+		}
+		auto done = finishedIndex_.equal_range(entry.key);
+		for (auto it = done.first; it != done.second && !future.valid(); ++it) {
+			if (it->second->parameters == parameters
+					&& rmsd(it->second->trace, entry.trace) <= KNOT_CACHE_RMSD) {
+				future = it->second->result;
+				finished_.splice(finished_.begin(), finished_, it->second);
+			}
+		}
+		if (future.valid()) {
+			hitCount_++;
+			lock.unlock();
+			if (cached) {
+				*cached = true;
+			}
+			result = future.get();
+			result.crossings = KNOT_CROSSINGS_UNKNOWN;
+			return result;
+		}
+		// later threads with the same chain wait for this result
+		entry.result = promise.get_future().share();
+		inFlight_.emplace(entry.key, &entry);
+	}
+	fromDisk = !directory_.empty() && load(entry, result);
+	if (!fromDisk) {
+		try {
+			result = compute();
+		} catch (...) {
+			promise.set_exception(std::current_exception());
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto running = inFlight_.equal_range(entry.key);
+			for (auto it = running.first; it != running.second; ++it) {
+				if (it->second == &entry) {
+					inFlight_.erase(it);
+					break;
+				}
+			}
+			throw;
+		}
+	}
+	promise.set_value(result);
+	// waiting threads already have the result, no lock is held here
+	if (!fromDisk && !directory_.empty()) {
+		store(entry, result);
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		(fromDisk ? diskHitCount_ : computeCount_)++;
+		retire(entry);
+	}
+	if (cached) {
+		*cached = fromDisk;
+	}
+	return result;
+}
+
+std::size_t KnotResultCache::hitCount() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return hitCount_;
+}
+
+std::size_t KnotResultCache::diskHitCount() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return diskHitCount_;
+}
+
+std::size_t KnotResultCache::computeCount() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	return computeCount_;
+}
+
+PhaseProfiler::PhaseProfiler() {
+	for (int c = 0; c < N_COUNTER; c++) {
+		fd_[c] = -1;
+		slot_[c] = 0;
+	}
+	memset(start_, 0, sizeof(start_));
+	running_ = false;
+	phase_ = PARSE;
+	residues_ = 0;
+	structures_ = 0;
+	structureCount_ = 0;
+	residueTotal_ = 0;
+	memset(structure_, 0, sizeof(structure_));
+	memset(total_, 0, sizeof(total_));
+}
+
+PhaseProfiler::~PhaseProfiler() {
+	close();
+}
+
+int PhaseProfiler::open() {
+	int nFailed = 0, nSlot = 0;
+	close();
+#ifdef __linux__
+	const std::uint32_t type[N_COUNTER] = { PERF_TYPE_HARDWARE,
+			PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE,
+			PERF_TYPE_HARDWARE };
+	const std::uint64_t config[N_COUNTER] = { PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_L1D
+					| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+					| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+	for (int c = 0; c < N_COUNTER; c++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type[c];
+		attr.config = config[c];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+				| PERF_FORMAT_TOTAL_TIME_RUNNING;
+		// there is no group without its leader
+		if (c != CYCLES && fd_[CYCLES] < 0) {
+			nFailed++;
+			continue;
+		}
+		fd_[c] = (int) syscall(SYS_perf_event_open, &attr, 0, -1,
+				c == CYCLES ? -1 : fd_[CYCLES], 0);
+		if (fd_[c] < 0) {
+			nFailed++;
+		} else {
+			slot_[c] = nSlot++;
+		}
+	}
+#else
+	nFailed = N_COUNTER;
+#endif
+	return nFailed;
+}
+
+void PhaseProfiler::close() {
+#ifdef __linux__
+	// members first, the leader holds the group
+	for (int c = N_COUNTER - 1; c >= 0; c--) {
+		if (fd_[c] >= 0) {
+			::close(fd_[c]);
+		}
+		fd_[c] = -1;
+	}
+#endif
+}
+
+/* one read of the group gives
+ *   nr, time enabled, time running, nr values in the order opened
+ */
+void PhaseProfiler::readCounters(std::uint64_t *values) {
+	memset(values, 0, (N_COUNTER + 2) * sizeof(std::uint64_t));
+#ifdef __linux__
+	std::uint64_t group[3 + N_COUNTER];
+	if (fd_[CYCLES] < 0
+			|| ::read(fd_[CYCLES], group, sizeof(group))
+					< (ssize_t) (3 * sizeof(std::uint64_t))) {
+		return;
+	}
+	for (int c = 0; c < N_COUNTER; c++) {
+		if (fd_[c] >= 0 && (std::uint64_t) slot_[c] < group[0]) {
+			values[c] = group[3 + slot_[c]];
+		}
+	}
+	values[N_COUNTER] = group[1];
+	values[N_COUNTER + 1] = group[2];
+#endif
+}
+
+void PhaseProfiler::beginStructure(const std::string &name) {
+	end();
+	name_ = name;
+	residues_ = 0;
+	structures_ = 0;
+	memset(structure_, 0, sizeof(structure_));
+}
+
+void PhaseProfiler::setResidues(std::size_t residues) {
+	residues_ = residues;
+	structures_ = 1;
+}
+
+void PhaseProfiler::addResidues(std::size_t residues) {
+	residues_ += residues;
+	structures_++;
+}
+
+void PhaseProfiler::begin(Phase phase) {
+	end();
+	phase_ = phase;
+	running_ = true;
+	wallStart_ = std::chrono::steady_clock::now();
+	readCounters(start_);
+}
+
+void PhaseProfiler::end() {
+	std::uint64_t stop[N_COUNTER + 2];
+	if (!running_) {
+		return;
+	}
+	readCounters(stop);
+	structure_[phase_].milliseconds += std::chrono::duration<double,
+			std::milli>(std::chrono::steady_clock::now() - wallStart_).count();
+	// the group only counted while it was running on the PMU
+	const std::uint64_t enabled = stop[N_COUNTER] - start_[N_COUNTER];
+	const std::uint64_t running = stop[N_COUNTER + 1] - start_[N_COUNTER + 1];
+	const double scale = running ? (double) enabled / running : 0.0;
+	for (int c = 0; c < N_COUNTER; c++) {
+		structure_[phase_].counter[c] += (std::uint64_t) llround(
+				(double) (stop[c] - start_[c]) * scale);
+	}
+	running_ = false;
+}
+
+/* IPC and misses per thousand instructions, counters that are
+ * not available print n/a
+ */
+void PhaseProfiler::printTable(FILE *out, const Sample *samples) {
+	const char *names[N_PHASE + 1] = { "parse", "extract", "smooth", "detect",
+			"export", "total" };
+	char field[N_COUNTER][32];
+	Sample sum;
+	memset(&sum, 0, sizeof(sum));
+	fprintf(out, "%-8s %10s %14s %14s %6s %8s %8s %8s\n", "phase", "ms",
+			"cycles", "instructions", "IPC", "L1D/ki", "LLC/ki", "br/ki");
+	for (int p = 0; p <= N_PHASE; p++) {
+		const Sample *s = &sum;
+		if (p < N_PHASE) {
+			s = samples + p;
+			sum.milliseconds += s->milliseconds;
+			for (int c = 0; c < N_COUNTER; c++) {
+				sum.counter[c] += s->counter[c];
+			}
+		}
+		const double instructions = (double) s->counter[INSTRUCTIONS];
+		for (int c = 0; c < N_COUNTER; c++) {
+			if (fd_[c] < 0 || (c != CYCLES && fd_[INSTRUCTIONS] < 0)) {
+				snprintf(field[c], sizeof(field[c]), "n/a");
+			} else if (c == CYCLES || c == INSTRUCTIONS) {
+				snprintf(field[c], sizeof(field[c]), "%llu",
+						(unsigned long long) s->counter[c]);
+			} else {
+				snprintf(field[c], sizeof(field[c]), "%.2f",
+						instructions > 0 ?
+								1000.0 * s->counter[c] / instructions : 0.0);
+			}
+		}
+		char ipc[32] = "n/a";
+		if (fd_[CYCLES] >= 0 && fd_[INSTRUCTIONS] >= 0) {
+			snprintf(ipc, sizeof(ipc), "%.2f",
+					s->counter[CYCLES] ?
+							instructions / s->counter[CYCLES] : 0.0);
+		}
+		fprintf(out, "%-8s %10.3f %14s %14s %6s %8s %8s %8s\n", names[p],
+				s->milliseconds, field[CYCLES], field[INSTRUCTIONS], ipc,
+				field[L1D_MISSES], field[LLC_MISSES], field[BRANCH_MISSES]);
+	}
+}
+
+void PhaseProfiler::endStructure(FILE *out) {
+	end();
+	if (out) {
+		fprintf(out, "Profile: %s Residues: %zu\n", name_.c_str(), residues_);
+		printTable(out, structure_);
+	}
+	for (int p = 0; p < N_PHASE; p++) {
+		total_[p].milliseconds += structure_[p].milliseconds;
+		for (int c = 0; c < N_COUNTER; c++) {
+			total_[p].counter[c] += structure_[p].counter[c];
+		}
+	}
+	structureCount_ += structures_;
+	residueTotal_ += residues_;
+	residues_ = 0;
+	structures_ = 0;
+	memset(structure_, 0, sizeof(structure_));
+}
+
+void PhaseProfiler::merge(const PhaseProfiler &other) {
+	for (int p = 0; p < N_PHASE; p++) {
+		total_[p].milliseconds += other.total_[p].milliseconds;
+		for (int c = 0; c < N_COUNTER; c++) {
+			total_[p].counter[c] += other.total_[p].counter[c];
+		}
+	}
+	structureCount_ += other.structureCount_;
+	residueTotal_ += other.residueTotal_;
+}
+
+void PhaseProfiler::report(FILE *out) {
+	fprintf(out, "Profile: %zu structures Residues: %zu\n", structureCount_,
+			residueTotal_);
+	printTable(out, total_);
+}
+
+PhaseProfiler& ThreadProfilers::local() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::unique_ptr<PhaseProfiler> &profiler =
+			profilers_[std::this_thread::get_id()];
+	if (!profiler) {
+		profiler = std::make_unique<PhaseProfiler>();
+		profiler->open();
+	}
+	return *profiler;
+}
+
+void ThreadProfilers::mergeInto(PhaseProfiler &profiler) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto &entry : profilers_) {
+		profiler.merge(*entry.second);
+	}
+}
+
+// Bytes of a PDB or mmCIF file per residue, for manifests without counts
+#define SHARD_BYTES_PER_RESIDUE 700
+// crossings is - for chains that were not smoothed
+#define SHARD_RESULT_HEADER "#path\tstatus\tcode\tresidues\tknotted\tconverged\tsweeps\tprescreened\tcrossings"
+
+std::size_t ShardPlan::estimateResidues(const std::string &path) {
+	std::error_code ec;
+	std::uintmax_t size = std::filesystem::file_size(path, ec);
+	if (ec) {
+		return 1;
+	}
+	return std::max<std::size_t>(1, size / SHARD_BYTES_PER_RESIDUE);
+}
+
+int ShardPlan::load(const char *manifestPath) {
+	std::string line;
+	std::ifstream manifest(manifestPath);
+	// shards may be started from any working directory
+	std::filesystem::path directory =
+			std::filesystem::path(manifestPath).parent_path();
+	if (!manifest) {
+		return 1;
+	}
+	entries_.clear();
+	while (std::getline(manifest, line)) {
+		ManifestEntry entry;
+		std::size_t end = line.find_last_not_of(" \t\r");
+		if (end == std::string::npos || line[line.find_first_not_of(" \t")] == '#') {
+			continue;
+		}
+		line.erase(end + 1);
+		line.erase(0, line.find_first_not_of(" \t"));
+		// a trailing number is the residue count, paths may contain spaces
+		std::size_t split = line.find_last_of(" \t");
+		entry.residues = 0;
+		if (split != std::string::npos
+				&& line.find_first_not_of("0123456789", split + 1)
+						== std::string::npos) {
+			entry.residues = strtoul(line.c_str() + split + 1, nullptr, 10);
+			line.erase(line.find_last_not_of(" \t", split) + 1);
+		}
+		entry.path = line;
+		entry.resolvedPath = std::filesystem::path(line).is_relative() ?
+				(directory / line).string() : line;
+		if (entry.residues == 0) {
+			entry.residues = estimateResidues(entry.resolvedPath);
+		}
+		entry.cost = (double) entry.residues * (double) entry.residues;
+		entry.shard = 0;
+		entries_.push_back(entry);
+	}
+	return 0;
+}
+
+void ShardPlan::assign(unsigned int nShard) {
+	std::vector<std::size_t> order(entries_.size());
+	nShard = std::max(nShard, 1u);
+	shardCost_.assign(nShard, 0.0);
+	for (std::size_t i = 0; i < order.size(); i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(),
+			[this](std::size_t a, std::size_t b) {
+				return entries_[a].cost > entries_[b].cost;
+			});
+	for (std::size_t i : order) {
+		unsigned int cheapest = 0;
+		for (unsigned int s = 1; s < nShard; s++) {
+			if (shardCost_[s] < shardCost_[cheapest]) {
+				cheapest = s;
+			}
+		}
+		entries_[i].shard = cheapest;
+		shardCost_[cheapest] += entries_[i].cost;
+	}
+}
+
+const std::vector<ManifestEntry>& ShardPlan::entries() {
+	return entries_;
+}
+
+double ShardPlan::shardCost(unsigned int shard) {
+	return shard < shardCost_.size() ? shardCost_[shard] : 0.0;
+}
+
+std::string ShardPlan::resultFileName(const std::string &prefix,
+		unsigned int shard, unsigned int nShard) {
+	return prefix + ".shard-" + std::to_string(shard) + "-of-"
+			+ std::to_string(nShard) + ".tsv";
+}
+
+int ShardPlan::run(unsigned int shard, const std::string &prefix,
+		const Read &read, bool extendTermini, bool prescreen,
+		PhaseProfiler *profiler) {
+	int RC = 0;
+	std::vector<const ManifestEntry*> pending;
+	std::string path = resultFileName(prefix, shard,
+			(unsigned int) shardCost_.size());
+	FILE *file = fopen(path.c_str(), "w");
+	if (file == nullptr) {
+		return 1;
+	}
+	fprintf(file, "%s\n", SHARD_RESULT_HEADER);
+	for (const ManifestEntry &entry : entries_) {
+		if (entry.shard == shard) {
+			pending.push_back(&entry);
+		}
+	}
+	// neighbours in this order have about the same length
+	std::stable_sort(pending.begin(), pending.end(),
+			[](const ManifestEntry *a, const ManifestEntry *b) {
+				return a->residues < b->residues;
+			});
+	for (std::size_t first = 0; first < pending.size(); first +=
+			TAYLOR_BATCH_LANES) {
+		const std::size_t last = std::min(pending.size(),
+				first + TAYLOR_BATCH_LANES);
+		std::vector<std::unique_ptr<DoubleMatrix>> matrices;
+		std::vector<std::size_t> lane;
+		std::vector<int> code(last - first, 0);
+		if (profiler) {
+			profiler->beginStructure(pending[first]->path);
+		}
+		for (std::size_t k = first; k < last; k++) {
+			std::unique_ptr<DoubleMatrix> matrix;
+			if (profiler) {
+				profiler->begin(PhaseProfiler::PARSE);
+			}
+			code[k - first] = read(pending[k]->resolvedPath, matrix);
+			if (code[k - first] == 0 && matrix == nullptr) {
+				code[k - first] = -1;
+			}
+			lane.push_back(matrices.size());
+			if (code[k - first] == 0) {
+				if (profiler) {
+					profiler->addResidues(matrix->s);
+				}
+				matrices.push_back(std::move(matrix));
+			}
+		}
+		if (profiler) {
+			profiler->begin(PhaseProfiler::SMOOTH);
+		}
+		std::vector<KnotResult> results = TaylorBatchAlgorithm::detect(
+				matrices, extendTermini, prescreen);
+		if (profiler) {
+			profiler->begin(PhaseProfiler::EXPORT);
+		}
+		for (std::size_t k = first; k < last; k++) {
+			KnotResult result = { };
+			char crossings[16] = "-";
+			if (code[k - first] == 0) {
+				result = results[lane[k - first]];
+			} else {
+				RC = 2;
+			}
+			if (result.crossings != KNOT_CROSSINGS_UNKNOWN) {
+				snprintf(crossings, sizeof(crossings), "%u", result.crossings);
+			}
+			fprintf(file, "%s\t%s\t%d\t%zu\t%s\t%s\t%u\t%s\t%s\n",
+					pending[k]->path.c_str(), code[k - first] ? "failed" : "ok",
+					code[k - first], result.residues,
+					result.knotted ? "yes" : "no",
+					result.converged ? "yes" : "no", result.sweeps,
+					result.prescreened ? "yes" : "no", crossings);
+		}
+		// finished entries survive a node that goes down
+		fflush(file);
+		if (profiler) {
+			profiler->endStructure(nullptr);
+		}
+	}
+	if (fclose(file) != 0) {
+		return 1;
+	}
+	return RC;
+}
+
+int ShardPlan::merge(const std::string &prefix, unsigned int nShard,
+		FILE *report) {
+	std::unordered_map<std::string, std::string> lines;
+	std::string line;
+	std::size_t nOk = 0, nFailed = 0, nMissing = 0;
+	for (unsigned int s = 0; s < nShard; s++) {
+		std::ifstream shardFile(resultFileName(prefix, s, nShard));
+		if (!shardFile) {
+			fprintf(report, "Shard %u/%u: no result file\n", s, nShard);
+			continue;
+		}
+		while (std::getline(shardFile, line)) {
+			/* a shard that was killed may leave half a line, every
+			 * record ends with a newline and a number or -
+			 */
+			if (shardFile.eof() || line.empty() || line[0] == '#'
+					|| std::count(line.begin(), line.end(), '\t')
+							!= std::count(SHARD_RESULT_HEADER,
+									SHARD_RESULT_HEADER
+											+ strlen(SHARD_RESULT_HEADER), '\t')
+					|| line.back() == '\t'
+					|| (line.compare(line.find_last_of('\t') + 1,
+							std::string::npos, "-") != 0
+							&& line.find_first_not_of("0123456789",
+									line.find_last_of('\t') + 1)
+									!= std::string::npos)) {
+				continue;
+			}
+			lines[line.substr(0, line.find('\t'))] = line;
+		}
+	}
+	std::string mergedPath = prefix + ".tsv";
+	FILE *merged = fopen(mergedPath.c_str(), "w");
+	if (merged == nullptr) {
+		return 1;
+	}
+	fprintf(merged, "%s\n", SHARD_RESULT_HEADER);
+	for (const ManifestEntry &entry : entries_) {
+		auto found = lines.find(entry.path);
+		if (found == lines.end()) {
+			fprintf(report, "Missing: %s\n", entry.path.c_str());
+			nMissing++;
+			continue;
+		}
+		fprintf(merged, "%s\n", found->second.c_str());
+		if (found->second.compare(entry.path.size() + 1, 3, "ok\t") == 0) {
+			nOk++;
+		} else {
+			fprintf(report, "Failed: %s\n", entry.path.c_str());
+			nFailed++;
+		}
+	}
+	if (fclose(merged) != 0) {
+		return 1;
+	}
+	fprintf(report, "Merged %s: %zu entries, %zu ok, %zu failed, %zu missing\n",
+			mergedPath.c_str(), entries_.size(), nOk, nFailed, nMissing);
+	return nFailed || nMissing ? 2 : 0;
+}
+
+int PDBModelFrames::open(const char *path) {
+	file_.open(path);
+	chainId_ = 0;
+	return file_ ? 0 : 1;
+}
+
+int PDBModelFrames::readFrame(std::vector<float> &trace) {
+	trace.clear();
+	while (std::getline(file_, line_)) {
+		if (line_.compare(0, 6, "ENDMDL") == 0
+				|| (line_.compare(0, 3, "END") == 0 && line_.size() >= 3
+						&& (line_.size() == 3 || line_[3] == ' '))) {
+			if (!trace.empty()) {
+				return 0;
+			}
+			continue;
+		}
+		// " CA " in columns 13-16 is an alpha carbon, calcium is "CA  "
+		if ((line_.compare(0, 6, "ATOM  ") != 0
+				&& line_.compare(0, 6, "HETATM") != 0) || line_.size() < 54
+				|| line_.compare(12, 4, " CA ") != 0
+				|| (line_[16] != ' ' && line_[16] != 'A')) {
+			continue;
+		}
+		if (chainId_ == 0) {
+			chainId_ = line_[21];
+		}
+		if (line_[21] != chainId_) {
+			continue;
+		}
+		trace.push_back(strtof(line_.substr(30, 8).c_str(), nullptr));
+		trace.push_back(strtof(line_.substr(38, 8).c_str(), nullptr));
+		trace.push_back(strtof(line_.substr(46, 8).c_str(), nullptr));
+	}
+	if (file_.bad()) {
+		return 2;
+	}
+	return trace.empty() ? 1 : 0;
+}
+
+int PDBModelFrames::carbonAlphaIndices(const char *path,
+		std::vector<std::size_t> &indices) {
+	std::string line;
+	std::size_t iAtom = 0;
+	char chainId = 0;
+	std::ifstream file(path);
+	if (!file) {
+		return 1;
+	}
+	indices.clear();
+	while (std::getline(file, line)) {
+		if (line.compare(0, 6, "ENDMDL") == 0) {
+			break;
+		}
+		if (line.compare(0, 6, "ATOM  ") != 0
+				&& line.compare(0, 6, "HETATM") != 0) {
+			continue;
+		}
+		if (line.size() >= 22 && line.compare(12, 4, " CA ") == 0
+				&& (line[16] == ' ' || line[16] == 'A')) {
+			if (chainId == 0) {
+				chainId = line[21];
+			}
+			if (line[21] == chainId) {
+				indices.push_back(iAtom);
+			}
+		}
+		iAtom++;
+	}
+	return indices.empty() ? 2 : 0;
+}
+
+DCDFrames::DCDFrames() {
+	file_ = nullptr;
+	swap_ = false;
+	hasExtraBlock_ = false;
+	has4D_ = false;
+	nAtom_ = 0;
+}
+
+DCDFrames::~DCDFrames() {
+	if (file_) {
+		fclose(file_);
+	}
+}
+
+/* DCD is written as Fortran unformatted records, the payload is framed
+ * by its length in bytes. Returns 0, 1 at the end of the file and 2 when
+ * the record is damaged.
+ */
+int DCDFrames::readRecord() {
+	std::uint32_t head, tail;
+	auto order = [this](std::uint32_t v) {
+		return swap_ ? ((v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000)
+						| (v << 24)) : v;
+	};
+	if (fread(&head, 4, 1, file_) != 1) {
+		return 1;
+	}
+	head = order(head);
+	record_.resize(head);
+	if ((head && fread(record_.data(), 1, head, file_) != head)
+			|| fread(&tail, 4, 1, file_) != 1 || order(tail) != head) {
+		return 2;
+	}
+	if (swap_) {
+		for (std::size_t i = 0; i + 3 < record_.size(); i += 4) {
+			std::swap(record_[i], record_[i + 3]);
+			std::swap(record_[i + 1], record_[i + 2]);
+		}
+	}
+	return 0;
+}
+
+int DCDFrames::open(const char *path, const char *topologyPath) {
+	std::int32_t control[20], nAtom;
+	std::uint32_t marker;
+	if (PDBModelFrames::carbonAlphaIndices(topologyPath, indices_)) {
+		return 1;
+	}
+	file_ = fopen(path, "rb");
+	if (file_ == nullptr) {
+		return 1;
+	}
+	// the first record is 84 bytes long, otherwise the byte order differs
+	if (fread(&marker, 4, 1, file_) != 1) {
+		return 2;
+	}
+	swap_ = marker != 84;
+	rewind(file_);
+	// the header words are swapped as a whole, "CORD" is compared raw
+	if (readRecord() || record_.size() != 84) {
+		return 2;
+	}
+	if (swap_) {
+		std::swap(record_[0], record_[3]);
+		std::swap(record_[1], record_[2]);
+	}
+	if (memcmp(record_.data(), "CORD", 4) != 0) {
+		return 2;
+	}
+	memcpy(control, record_.data() + 4, sizeof(control));
+	// a CHARMM version in the last word enables the extra blocks
+	hasExtraBlock_ = control[19] != 0 && control[10] != 0;
+	has4D_ = control[19] != 0 && control[11] != 0;
+	if (control[8] != 0) {
+		return 2;
+	}
+	// title record, then the atom count
+	if (readRecord() || readRecord() || record_.size() != 4) {
+		return 2;
+	}
+	memcpy(&nAtom, record_.data(), 4);
+	nAtom_ = (std::size_t) nAtom;
+	for (std::size_t i : indices_) {
+		if (i >= nAtom_) {
+			return 2;
+		}
+	}
+	return 0;
+}
+
+int DCDFrames::readFrame(std::vector<float> &trace) {
+	int RC;
+	if (file_ == nullptr) {
+		return 2;
+	}
+	// the unit cell of CHARMM files comes first
+	if (hasExtraBlock_ && (RC = readRecord()) != 0) {
+		return RC;
+	}
+	for (int axis = 0; axis < 3; axis++) {
+		RC = readRecord();
+		if (RC || record_.size() != 4 * nAtom_) {
+			// a frame cut short at the end of the file is not an error
+			return axis == 0 && !hasExtraBlock_ && RC == 1 ? 1 : 2;
+		}
+		coordinate_[axis].resize(nAtom_);
+		memcpy(coordinate_[axis].data(), record_.data(), record_.size());
+	}
+	if (has4D_ && readRecord()) {
+		return 2;
+	}
+	trace.resize(3 * indices_.size());
+	for (std::size_t i = 0; i < indices_.size(); i++) {
+		trace[3 * i] = coordinate_[0][indices_[i]];
+		trace[3 * i + 1] = coordinate_[1][indices_[i]];
+		trace[3 * i + 2] = coordinate_[2][indices_[i]];
+	}
+	return 0;
+}
+
+TrajectoryAnalyzer::TrajectoryAnalyzer(unsigned int nThreads,
+		std::size_t blockSize) {
+	nThreads_ = std::max(nThreads, 1u);
+	blockSize_ = std::max<std::size_t>(blockSize, 1);
+	residues_ = 0;
+	frameCount_ = 0;
+	warmCount_ = 0;
+	seconds_ = 0.0;
+	nextFrame_ = 0;
+	profilers_ = nullptr;
+	extendTermini_ = false;
+	prescreen_ = false;
+}
+
+void TrajectoryAnalyzer::setProfilers(ThreadProfilers *profilers) {
+	profilers_ = profilers;
+}
+
+void TrajectoryAnalyzer::setExtendTermini(bool extendTermini) {
+	extendTermini_ = extendTermini;
+}
+
+void TrajectoryAnalyzer::setPrescreen(bool prescreen) {
+	prescreen_ = prescreen;
+}
+
+/* closest points of two segments, Ericson, Real-Time Collision
+ * Detection, 5.1.9
+ */
+double TrajectoryAnalyzer::segmentDistance(const float *p0, const float *q0,
+		const float *p1, const float *q1) {
+	double d1[3], d2[3], r[3], c[3];
+	double s, t;
+	for (int i = 0; i < 3; i++) {
+		d1[i] = (double) q0[i] - p0[i];
+		d2[i] = (double) q1[i] - p1[i];
+		r[i] = (double) p0[i] - p1[i];
+	}
+	const double a = DOT(d1, d1);
+	const double e = DOT(d2, d2);
+	const double f = DOT(d2, r);
+	if (a == 0.0 && e == 0.0) {
+		s = t = 0.0;
+	} else if (a == 0.0) {
+		s = 0.0;
+		t = std::clamp(f / e, 0.0, 1.0);
+	} else {
+		const double cc = DOT(d1, r);
+		if (e == 0.0) {
+			t = 0.0;
+			s = std::clamp(-cc / a, 0.0, 1.0);
+		} else {
+			const double b = DOT(d1, d2);
+			const double denominator = a * e - b * b;
+			s = denominator > 0.0 ?
+					std::clamp((b * f - cc * e) / denominator, 0.0, 1.0) : 0.0;
+			t = (b * s + f) / e;
+			if (t < 0.0) {
+				t = 0.0;
+				s = std::clamp(-cc / a, 0.0, 1.0);
+			} else if (t > 1.0) {
+				t = 1.0;
+				s = std::clamp((b - cc) / a, 0.0, 1.0);
+			}
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		c[i] = (p0[i] + d1[i] * s) - (p1[i] + d2[i] * t);
+	}
+	return sqrt(DOT(c, c));
+}
+
+double TrajectoryAnalyzer::clearance(const float *x, std::size_t nVertex) {
+	double shortest = HUGE_VAL;
+	for (std::size_t i = 0; i + 1 < nVertex; i++) {
+		for (std::size_t k = i + 2; k + 1 < nVertex; k++) {
+			shortest = std::min(shortest,
+					segmentDistance(x + 3 * i, x + 3 * i + 3, x + 3 * k,
+							x + 3 * k + 3));
+		}
+	}
+	return shortest;
+}
+
+double TrajectoryAnalyzer::maxDisplacement(const float *a, const float *b,
+		std::size_t nVertex) {
+	double longest = 0.0, d[3];
+	for (std::size_t i = 0; i < 3 * nVertex; i += 3) {
+		SUB3(d, (a + i), (b + i));
+		longest = std::max(longest, DOT(d, d));
+	}
+	return sqrt(longest);
+}
+
+void TrajectoryAnalyzer::analyzeBlock(Block &block, const Output &output) {
+	std::vector<FrameVerdict> verdicts(block.nFrame);
+	// the trace that was smoothed last, with its termini when extended
+	std::unique_ptr<DoubleMatrix> reference;
+	double referenceClearance = 0.0;
+	std::size_t nWarm = 0;
+	PhaseProfiler *profiler = profilers_ ? &profilers_->local() : nullptr;
+	if (profiler) {
+		profiler->beginStructure("frames");
+	}
+	for (std::size_t f = 0; f < block.nFrame; f++) {
+		const float *x = block.coordinates.data() + f * 3 * residues_;
+		FrameVerdict &verdict = verdicts[f];
+		verdict.frame = block.first + f;
+		if (profiler) {
+			profiler->addResidues(residues_);
+			profiler->begin(PhaseProfiler::DETECT);
+		}
+		std::unique_ptr<DoubleMatrix> matrix = std::make_unique<DoubleMatrix>(
+				residues_);
+		std::copy(x, x + 3 * residues_, matrix->m);
+		/* the extended termini move with the whole chain, so they are
+		 * part of the trace that must stay clear of itself
+		 */
+		std::unique_ptr<DoubleMatrix> trace =
+				extendTermini_ ?
+						TaylorKnotAlgorithm::extendTermini(*matrix) : nullptr;
+		const DoubleMatrix &smoothed = trace ? *trace : *matrix;
+		if (reference
+				&& 2.0 * maxDisplacement(reference->m, smoothed.m, smoothed.s)
+						< referenceClearance) {
+			verdict.knotted = verdicts[f - 1].knotted;
+			verdict.warm = true;
+			verdict.prescreened = false;
+			verdict.crossings = KNOT_CROSSINGS_UNKNOWN;
+			verdict.sweeps = 0;
+			nWarm++;
+			continue;
+		}
+		referenceClearance = clearance(smoothed.m, smoothed.s);
+		if (trace) {
+			reference = std::move(trace);
+		} else {
+			reference = std::make_unique<DoubleMatrix>(residues_);
+			std::copy(x, x + 3 * residues_, reference->m);
+		}
+		if (profiler) {
+			profiler->begin(PhaseProfiler::SMOOTH);
+		}
+		// detect() extends the termini again, the same way
+		TaylorKnotAlgorithm taylorAlgorithm;
+		taylorAlgorithm.setExtendTermini(extendTermini_);
+		taylorAlgorithm.setPrescreen(prescreen_);
+		KnotResult result = taylorAlgorithm.detect(std::move(matrix));
+		verdict.knotted = result.knotted;
+		verdict.crossings = result.crossings;
+		verdict.sweeps = result.sweeps;
+		verdict.prescreened = result.prescreened;
+		verdict.warm = false;
+	}
+	if (profiler) {
+		profiler->endStructure(nullptr);
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	warmCount_ += nWarm;
+	done_[block.first] = std::move(verdicts);
+	// blocks finish out of order, the output follows the frames
+	while (!done_.empty() && done_.begin()->first == nextFrame_) {
+		for (const FrameVerdict &verdict : done_.begin()->second) {
+			output(verdict);
+		}
+		nextFrame_ += done_.begin()->second.size();
+		done_.erase(done_.begin());
+	}
+}
+
+int TrajectoryAnalyzer::run(FrameSource &source, const Output &output) {
+	std::vector<float> trace;
+	int RC = 0, readRC;
+	auto start = std::chrono::steady_clock::now();
+	Block block;
+	frameCount_ = 0;
+	warmCount_ = 0;
+	nextFrame_ = 0;
+	residues_ = 0;
+	done_.clear();
+	{
+		WorkerPool<Block> pool(nThreads_, 2 * nThreads_,
+				[this, &output](Block &job) {
+					analyzeBlock(job, output);
+				});
+		block.first = 0;
+		block.nFrame = 0;
+		while ((readRC = source.readFrame(trace)) == 0) {
+			if (frameCount_ == 0) {
+				residues_ = trace.size() / 3;
+			}
+			if (trace.size() != 3 * residues_ || residues_ == 0) {
+				RC = 2;
+				break;
+			}
+			block.coordinates.insert(block.coordinates.end(), trace.begin(),
+					trace.end());
+			block.nFrame++;
+			frameCount_++;
+			if (block.nFrame == blockSize_) {
+				pool.push(std::move(block));
+				block = Block();
+				block.first = frameCount_;
+				block.nFrame = 0;
+			}
+		}
+		if (readRC == 2) {
+			RC = 2;
+		}
+		if (block.nFrame) {
+			pool.push(std::move(block));
+		}
+		pool.finish();
+	}
+	seconds_ = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+	return RC;
+}
+
+std::size_t TrajectoryAnalyzer::frameCount() {
+	return frameCount_;
+}
+
+std::size_t TrajectoryAnalyzer::warmCount() {
+	return warmCount_;
+}
+
+double TrajectoryAnalyzer::seconds() {
+	return seconds_;
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("O3")
+#endif
+TaylorBatchAlgorithm::TaylorBatchAlgorithm() {
+	nVertex_ = 0;
+	for (std::size_t l = 0; l < TAYLOR_BATCH_LANES; l++) {
+		length_[l] = 0;
+		sweeps_[l] = 0;
+		converged_[l] = false;
+	}
+}
+
+void TaylorBatchAlgorithm::setMatrices(
+		std::vector<std::unique_ptr<DoubleMatrix>> matrices) {
+	const std::size_t W = TAYLOR_BATCH_LANES;
+	matrices_ = std::move(matrices);
+	matrices_.resize(std::min(matrices_.size(), W));
+	nVertex_ = 0;
+	for (std::size_t l = 0; l < W; l++) {
+		length_[l] = l < matrices_.size() ? matrices_[l]->s : 0;
+		nVertex_ = std::max(nVertex_, length_[l]);
+		sweeps_[l] = 0;
+		converged_[l] = false;
+	}
+	// vertexes past the end of a chain are never read
+	x_.assign(nVertex_ * 3 * W, 0.0f);
+	for (std::size_t l = 0; l < matrices_.size(); l++) {
+		for (std::size_t i = 0; i < 3 * length_[l]; i++) {
+			x_[i * W + l] = matrices_[l]->m[i];
+		}
+	}
+}
+
+std::vector<std::unique_ptr<DoubleMatrix>> TaylorBatchAlgorithm::getMatrices() {
+	const std::size_t W = TAYLOR_BATCH_LANES;
+	for (std::size_t l = 0; l < matrices_.size(); l++) {
+		for (std::size_t i = 0; i < 3 * length_[l]; i++) {
+			matrices_[l]->m[i] = x_[i * W + l];
+		}
+	}
+	return std::move(matrices_);
+}
+
+unsigned int TaylorBatchAlgorithm::sweepCount(std::size_t lane) {
+	return sweeps_[lane];
+}
+
+bool TaylorBatchAlgorithm::isConverged(std::size_t lane) {
+	return converged_[lane];
+}
+
+/*
+ * One sweep of TaylorKnotAlgorithm::smooth() on every active lane.
+ * The lane loops have fixed bounds and no branches so the compiler
+ * can vectorize them.
+ */
+void TaylorBatchAlgorithm::sweep(const int *active, unsigned int *nMoved) {
+	const std::size_t W = TAYLOR_BATCH_LANES;
+	float *x = x_.data();
+	float *v0, *v1, *v2;
+	float v1p[3][TAYLOR_BATCH_LANES];
+	float low1[3][TAYLOR_BATCH_LANES], high1[3][TAYLOR_BATCH_LANES];
+	float low2[3][TAYLOR_BATCH_LANES], high2[3][TAYLOR_BATCH_LANES];
+	int blocked[TAYLOR_BATCH_LANES];
+	int hit1[TAYLOR_BATCH_LANES], hit2[TAYLOR_BATCH_LANES];
+	// 32 bit like the floats, so the lane masks fit the same vectors
+	int length[TAYLOR_BATCH_LANES];
+	std::size_t nOpen;
+
+	for (std::size_t l = 0; l < W; l++) {
+		nMoved[l] = 0;
+		length[l] = (int) length_[l];
+	}
+	/* segment {a;a+1} against triangles {i-1,i,i'} and {i,i',i+1} of every
+	 * open lane, the boxes are compared exactly as segmentCrossesTriangle()
+	 * does before the lanes that pass are handed to it
+	 */
+	auto check = [&](std::size_t a, int tri1, int tri2) {
+		const int end = (int) a + 1;
+		const float *p = x + a * 3 * W;
+		const float *q = p + 3 * W;
+		int candidate = 0;
+		for (std::size_t l = 0; l < W; l++) {
+			int h1 = tri1, h2 = tri2;
+			for (int axis = 0; axis < 3; axis++) {
+				const float pa = p[axis * W + l], qa = q[axis * W + l];
+				h1 &= !(((pa < low1[axis][l]) & (qa < low1[axis][l]))
+						| ((pa > high1[axis][l]) & (qa > high1[axis][l])));
+				h2 &= !(((pa < low2[axis][l]) & (qa < low2[axis][l]))
+						| ((pa > high2[axis][l]) & (qa > high2[axis][l])));
+			}
+			const int open = !blocked[l] & (end < length[l]);
+			hit1[l] = h1 & open;
+			hit2[l] = h2 & open;
+			candidate |= hit1[l] | hit2[l];
+		}
+		if (!candidate) {
+			return;
+		}
+		for (std::size_t l = 0; l < W; l++) {
+			if (!hit1[l] && !hit2[l]) {
+				continue;
+			}
+			float P[3], Q[3], A0[3], A1[3], A2[3], AP[3];
+			for (int axis = 0; axis < 3; axis++) {
+				P[axis] = p[axis * W + l];
+				Q[axis] = q[axis * W + l];
+				A0[axis] = v0[axis * W + l];
+				A1[axis] = v1[axis * W + l];
+				A2[axis] = v2[axis * W + l];
+				AP[axis] = v1p[axis][l];
+			}
+			if ((hit1[l]
+					&& GeometricPredicates::segmentCrossesTriangle(P, Q, A0, A1,
+							AP))
+					|| (hit2[l]
+							&& GeometricPredicates::segmentCrossesTriangle(P, Q,
+									A1, AP, A2))) {
+				blocked[l] = 1;
+				nOpen--;
+			}
+		}
+	};
+
+	for (std::size_t i = 1; i + 1 < nVertex_; i++) {
+		v0 = x + (i - 1) * 3 * W;
+		v1 = x + i * 3 * W;
+		v2 = x + (i + 1) * 3 * W;
+		nOpen = 0;
+		for (std::size_t l = 0; l < W; l++) {
+			blocked[l] = !(active[l] & ((int) i + 1 < length[l]));
+			nOpen += !blocked[l];
+		}
+		if (nOpen == 0) {
+			continue;
+		}
+		for (int axis = 0; axis < 3; axis++) {
+			for (std::size_t l = 0; l < W; l++) {
+				const float a0 = v0[axis * W + l], a1 = v1[axis * W + l], a2 =
+						v2[axis * W + l];
+				const float p = ((a0 + a2) / 2 + a1) / 2;
+				v1p[axis][l] = p;
+				low1[axis][l] = std::min(a0, std::min(a1, p));
+				high1[axis][l] = std::max(a0, std::max(a1, p));
+				low2[axis][l] = std::min(a1, std::min(p, a2));
+				high2[axis][l] = std::max(a1, std::max(p, a2));
+			}
+		}
+		// segments before i, {i-2;i-1} touches the first triangle
+		for (std::size_t a = 0; a + 1 < i && nOpen; a++) {
+			check(a, a + 2 < i, 1);
+		}
+		// segments after i, {i+1;i+2} touches the second triangle
+		for (std::size_t a = i + 1; a + 1 < nVertex_ && nOpen; a++) {
+			check(a, 1, a > i + 1);
+		}
+		for (std::size_t l = 0; l < W; l++) {
+			if (blocked[l]) {
+				continue;
+			}
+			float d[3];
+			for (int axis = 0; axis < 3; axis++) {
+				d[axis] = v1p[axis][l] - v1[axis * W + l];
+				v1[axis * W + l] = v1p[axis][l];
+			}
+			if (DOT(d, d) > TAYLOR_MOVE_EPSILON) {
+				nMoved[l]++;
+			}
+		}
+	}
+}
+
+unsigned int TaylorBatchAlgorithm::smoothAuto(unsigned int maxRepeat,
+		std::size_t minLanes) {
+	const std::size_t W = TAYLOR_BATCH_LANES;
+	int active[TAYLOR_BATCH_LANES];
+	unsigned int nMoved[TAYLOR_BATCH_LANES];
+	unsigned int nSweep = 0;
+	std::size_t nActive = 0;
+	for (std::size_t l = 0; l < W; l++) {
+		active[l] = l < matrices_.size() && maxRepeat > 0;
+		nActive += active[l];
+		sweeps_[l] = 0;
+		converged_[l] = false;
+	}
+	while (nActive > 0 && nActive >= minLanes) {
+		sweep(active, nMoved);
+		nSweep++;
+		nActive = 0;
+		for (std::size_t l = 0; l < W; l++) {
+			if (!active[l]) {
+				continue;
+			}
+			sweeps_[l]++;
+			if (nMoved[l] == 0) {
+				converged_[l] = true;
+				active[l] = 0;
+			} else if (sweeps_[l] >= maxRepeat) {
+				active[l] = 0;
+			}
+			nActive += active[l];
+		}
+	}
+	return nSweep;
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+std::vector<KnotResult> TaylorBatchAlgorithm::detect(
+		std::vector<std::unique_ptr<DoubleMatrix>> &matrices,
+		bool extendTermini, bool prescreen) {
+	std::vector<KnotResult> results(matrices.size());
+	std::vector<std::size_t> order, residues(matrices.size());
+	TaylorKnotAlgorithm taylorAlgorithm;
+	TaylorBatchAlgorithm batch;
+	// smooths chain c on its own, its termini are already extended
+	auto alone = [&](std::size_t c) {
+		KnotResult &result = results[c];
+		taylorAlgorithm.setMatrix(std::move(matrices[c]));
+		result.residues = residues[c];
+		if (TaylorKnotAlgorithm::multiResolution(residues[c], extendTermini)) {
+			result.sweeps = taylorAlgorithm.smoothMultiResolution();
+		} else {
+			result.sweeps = taylorAlgorithm.smoothAuto();
+		}
+		result.converged = taylorAlgorithm.isConverged();
+		result.prescreened = false;
+		result.crossings = taylorAlgorithm.crossingCount();
+		result.knotted = result.crossings >= TAYLOR_KNOT_MIN_CROSSINGS;
+		matrices[c] = taylorAlgorithm.getMatrix();
+	};
+	for (std::size_t c = 0; c < matrices.size(); c++) {
+		residues[c] = matrices[c]->s;
+		if (extendTermini) {
+			matrices[c] = TaylorKnotAlgorithm::extendTermini(*matrices[c]);
+		}
+		if (prescreen) {
+			PrescreenResult screen = KnotPrescreen::screen(*matrices[c],
+					residues[c]);
+			if (screen.unknotted) {
+				results[c].residues = residues[c];
+				results[c].sweeps = 0;
+				results[c].converged = true;
+				results[c].crossings = KNOT_CROSSINGS_UNKNOWN;
+				results[c].knotted = false;
+				results[c].prescreened = true;
+				continue;
+			}
+		}
+		if (residues[c] > TAYLOR_MULTIRES_LENGTH) {
+			alone(c);
+		} else {
+			order.push_back(c);
+		}
+	}
+	// lanes of similar length finish their sweeps at about the same time
+	std::stable_sort(order.begin(), order.end(),
+			[&matrices](std::size_t a, std::size_t b) {
+				return matrices[a]->s < matrices[b]->s;
+			});
+	std::size_t first = 0;
+	while (first < order.size()) {
+		std::vector<std::unique_ptr<DoubleMatrix>> lanes;
+		const double longest = matrices[order[first]]->s
+				* TAYLOR_BATCH_MAX_SPREAD;
+		std::size_t last = first + 1;
+		while (last < order.size() && last - first < TAYLOR_BATCH_LANES
+				&& matrices[order[last]]->s <= longest) {
+			last++;
+		}
+		if (last - first < TAYLOR_BATCH_MIN_LANES) {
+			alone(order[first]);
+			first++;
+			continue;
+		}
+		for (std::size_t k = first; k < last; k++) {
+			lanes.push_back(std::move(matrices[order[k]]));
+		}
+		batch.setMatrices(std::move(lanes));
+		batch.smoothAuto(1000, TAYLOR_BATCH_MIN_LANES);
+		lanes = batch.getMatrices();
+		for (std::size_t k = first; k < last; k++) {
+			const std::size_t c = order[k], l = k - first;
+			KnotResult &result = results[c];
+			result.residues = residues[c];
+			result.sweeps = batch.sweepCount(l);
+			result.converged = batch.isConverged(l);
+			result.prescreened = false;
+			taylorAlgorithm.setMatrix(std::move(lanes[l]));
+			// the lanes still moving are finished one at a time
+			if (!result.converged && result.sweeps < 1000) {
+				result.sweeps += taylorAlgorithm.smoothAuto(
+						1000 - result.sweeps);
+				result.converged = taylorAlgorithm.isConverged();
+			}
+			result.crossings = taylorAlgorithm.crossingCount();
+			result.knotted = result.crossings >= TAYLOR_KNOT_MIN_CROSSINGS;
+			matrices[c] = taylorAlgorithm.getMatrix();
+		}
+		first = last;
+	}
+	return results;
+}
+
+int CarbonAlphaReader::read(const char *path,
+		std::unique_ptr<DoubleMatrix> &matrix) {
+	int RC;
+	std::string extension = std::filesystem::path(path).extension().string();
+	matrix.reset();
+	if (extension == ".pdb" || extension == ".ent") {
+		PDBModelFrames models;
+		std::vector<float> trace;
+		if (models.open(path)) {
+			return 1;
+		}
+		if (models.readFrame(trace)) {
+			return 2;
+		}
+		matrix = std::make_unique<DoubleMatrix>(trace.size() / 3);
+		std::copy(trace.begin(), trace.end(), matrix->m);
+		return 0;
+	}
+	if (extension == ".cif") {
+		CIFCarbonAlphaStream stream;
+		stream.setFirstModelOnly(true);
+		RC = stream.read(path, [&matrix](ChainTrace trace) {
+			if (!matrix) {
+				matrix = std::move(trace.matrix);
+			}
+		});
+		if (RC) {
+			return RC;
+		}
+		return matrix ? 0 : 2;
+	}
+	return 3;
 }
 
 } // namespace PKD
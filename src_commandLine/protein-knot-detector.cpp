@@ -13,6 +13,7 @@
 #include <iostream>
 #include <filesystem>
 #include <memory>
+#include <thread>
 
 /* proteinKnotDetector 1.00
  * Includes the primary algorithm code and
@@ -23,6 +24,8 @@
 /* proteinKnotAnalyzer 1.00
  * Analysis utilities for PDB format support and
  * STEP file export for visualization
+ * MMDB and OCCT are only used when PKA_WITH_MMDB and PKA_WITH_OCCT
+ * are defined, the core build needs nothing but the standard library
  */
 #include "proteinKnotAnalyzer/amalgamated.h"
 
@@ -31,33 +34,344 @@ using namespace PKD;
 using namespace PKA;
 
 int main(int argc, char **argv) {
-	int RC, im, ir, errorCode;
+	int RC, errorCode;
+	std::unique_ptr<PKD::DoubleMatrix> carbonAlphaMatrix;
+#ifdef PKA_WITH_MMDB
+	int im, ir;
 	int nModels, nChains;
 	CModel **modelTable;
 	CChain **chainTable;
 	std::unique_ptr<CMMDBManager> MMDB;
-	std::unique_ptr<CMMDBManager> MMDBExport;
-	std::unique_ptr<PKD::DoubleMatrix> carbonAlphaMatrix;
+#endif
 
 	errorCode = 0;
+	RC = 0;
+#ifdef PKA_WITH_MMDB
 	MMDB = std::make_unique<CMMDBManager>();
+#endif
 
 	/*
 	 bool outputEachIteration = PKD::CommandLineOptions::output_each_iteration(argc,
 	 argv).value_or(false);
 	 std::string outputType =
 	 PKD::CommandLineOptions::output_type(argc, argv).value_or("pdb");
-	 fs::path inputFilePath = PKD::CommandLineOptions::input_file(argc, argv).value_or(
-	 "test.pdb");
 	 */
-	filesystem::path inputFilePath("2cab.pdb");
+	filesystem::path inputFilePath(
+			CommandLineOptions::input_file(argc, argv).value_or("2cab.pdb"));
 	string inputFileExtension = inputFilePath.extension().string();
 	string inputFileStem = inputFilePath.stem().string();
+	/* buried termini are moved out of the protein so both ends
+	 * are closed the same way on every run
+	 */
+	bool extendTermini = CommandLineOptions::extend_termini(argc, argv).value_or(
+			true);
+	// chains with a projection free of crossings are not smoothed
+	bool prescreen = CommandLineOptions::prescreen(argc, argv).value_or(true);
+	// only a single chain is smoothed with a time budget
+	std::optional<unsigned int> timeBudget = CommandLineOptions::time_budget_ms(
+			argc, argv);
+	/* phases are always timed, the hardware counters
+	 * are only opened when profiling
+	 */
+	PhaseProfiler profiler;
+	bool profiling = CommandLineOptions::profile(argc, argv).value_or(false);
+	if (profiling && profiler.open()) {
+		printf("Warning: some hardware counters are not available\n");
+	}
+	// worker threads count on their own counters
+	ThreadProfilers workerProfilers;
+
+	/* large assemblies are not loaded into MMDB, every chain is smoothed
+	 * while the rest of the file is still being read
+	 */
+	if (inputFileExtension == ".cif"
+			&& CommandLineOptions::stream_chains(argc, argv).value_or(false)) {
+		unsigned int nThreads = CommandLineOptions::threads(argc, argv).value_or(
+				std::max(std::thread::hardware_concurrency(), 1u));
+		if (timeBudget) {
+			printf("Warning: option 'time_budget_ms' is ignored when streaming\n");
+		}
+		/* identical copies of a chain are smoothed once, the parameters
+		 * name everything that changes the verdict
+		 */
+		KnotResultCache cache;
+		const std::string parameters = std::string(
+				"auto=1000 multiResolution>1000 stride=4")
+				+ (extendTermini ? " extendTermini=2" : "")
+				+ (prescreen ? " prescreen=13" : "");
+		cache.setDirectory(CommandLineOptions::cache_dir(argc, argv).value_or(""));
+		std::cout << "Streaming CIF file: " << inputFilePath << std::endl;
+		ThreadProfilers *chainProfilers = profiling ? &workerProfilers : nullptr;
+		ChainWorkerPool pool(nThreads, nThreads,
+				[&cache, &parameters, extendTermini, prescreen, chainProfilers](
+						ChainTrace &trace) {
+					bool cached = false;
+					PhaseProfiler *chainProfiler =
+							chainProfilers ? &chainProfilers->local() : nullptr;
+					if (chainProfiler) {
+						chainProfiler->beginStructure(trace.chainId);
+						chainProfiler->setResidues(trace.matrix->s);
+						chainProfiler->begin(PhaseProfiler::SMOOTH);
+					}
+					KnotResult result = cache.lookup(*trace.matrix, parameters,
+							[&trace, extendTermini, prescreen]() {
+								TaylorKnotAlgorithm taylorAlgorithm;
+								taylorAlgorithm.setExtendTermini(extendTermini);
+								taylorAlgorithm.setPrescreen(prescreen);
+								return taylorAlgorithm.detect(std::move(trace.matrix));
+							}, &cached);
+					if (chainProfiler) {
+						chainProfiler->begin(PhaseProfiler::EXPORT);
+					}
+					printf("Model SerNum#%d ChainId#%s Residues: %zu Sweeps: %u "
+							"Knot detected: %s%s%s\n", trace.modelId,
+							trace.chainId.c_str(), result.residues, result.sweeps,
+							result.knotted ? "yes" : "no",
+							result.prescreened ? " (pre-screened)" : "",
+							cached ? " (cached)" : "");
+					if (chainProfiler) {
+						chainProfiler->endStructure(nullptr);
+					}
+				});
+		CIFCarbonAlphaStream stream;
+		stream.setFirstModelOnly(true);
+		/* the reader thread is the parse phase, it includes the time
+		 * spent waiting for a free worker
+		 */
+		profiler.beginStructure(inputFileStem);
+		profiler.begin(PhaseProfiler::PARSE);
+		RC = stream.read(inputFilePath.string().c_str(),
+				[&pool](ChainTrace trace) {
+					pool.push(std::move(trace));
+				});
+		profiler.endStructure(nullptr);
+		pool.finish();
+		if (RC) {
+			printf(" ***** ERROR #%i READ: no alpha carbon coordinates\n", RC);
+		} else {
+			printf("Chains: %zu Computed: %zu Duplicates: %zu From cache: %zu\n",
+					stream.chainCount(), cache.computeCount(), cache.hitCount(),
+					cache.diskHitCount());
+			printf("Trace buffers allocated: %llu Reused: %llu "
+					"From other threads: %llu\n",
+					(unsigned long long) TraceBufferPool::allocationCount(),
+					(unsigned long long) TraceBufferPool::reuseCount(),
+					(unsigned long long) TraceBufferPool::sharedCount());
+			if (prescreen) {
+				printf("Pre-screen: %llu of %llu chains skipped (%.1f%%)\n",
+						(unsigned long long) KnotPrescreen::skippedCount(),
+						(unsigned long long) KnotPrescreen::screenedCount(),
+						KnotPrescreen::screenedCount() ?
+								100.0 * KnotPrescreen::skippedCount()
+										/ KnotPrescreen::screenedCount() :
+								0.0);
+			}
+		}
+		if (profiling) {
+			workerProfilers.mergeInto(profiler);
+			profiler.report();
+		}
+		system("pause");
+		return 0;
+	}
 
+	/* trajectories are read one frame at a time and blocks of frames
+	 * are smoothed in parallel, frames that barely moved reuse a verdict
+	 */
+	if (inputFileExtension == ".dcd"
+			|| CommandLineOptions::trajectory(argc, argv).value_or(false)) {
+		std::unique_ptr<FrameSource> source;
+		if (inputFileExtension == ".dcd") {
+			std::optional<std::string> topologyPath =
+					CommandLineOptions::topology(argc, argv);
+			std::unique_ptr<DCDFrames> dcd = std::make_unique<DCDFrames>();
+			RC = topologyPath ?
+					dcd->open(inputFilePath.string().c_str(),
+							topologyPath->c_str()) : 1;
+			source = std::move(dcd);
+		} else if (inputFileExtension == ".pdb") {
+			std::unique_ptr<PDBModelFrames> models = std::make_unique<
+					PDBModelFrames>();
+			RC = models->open(inputFilePath.string().c_str());
+			source = std::move(models);
+		} else {
+			RC = 1;
+		}
+		if (RC) {
+			printf(" ***** ERROR #%i: trajectories are read from multi-model "
+					"PDB files or from DCD files with --topology=file.pdb\n",
+					RC);
+			return RC;
+		}
+		unsigned int nThreads = CommandLineOptions::threads(argc, argv).value_or(
+				std::max(std::thread::hardware_concurrency(), 1u));
+		if (timeBudget) {
+			printf("Warning: option 'time_budget_ms' is ignored for trajectories\n");
+		}
+		string framesFileName;
+		framesFileName.append(inputFileStem).append("-frames.tsv");
+		FILE *framesFile = fopen(framesFileName.c_str(), "w");
+		if (framesFile == nullptr) {
+			printf(" ***** ERROR: could not write %s\n", framesFileName.c_str());
+			return 1;
+		}
+		std::cout << "Reading trajectory: " << inputFilePath << std::endl;
+		fprintf(framesFile,
+				"#frame\tknotted\tcrossings\tsweeps\twarm\tprescreened\n");
+		TrajectoryAnalyzer analyzer(nThreads);
+		analyzer.setProfilers(profiling ? &workerProfilers : nullptr);
+		// every frame gets the verdict it would get as a single chain
+		analyzer.setExtendTermini(extendTermini);
+		analyzer.setPrescreen(prescreen);
+		// the reader thread is the parse phase, as when streaming
+		profiler.beginStructure(inputFileStem);
+		profiler.begin(PhaseProfiler::PARSE);
+		RC = analyzer.run(*source, [framesFile](const FrameVerdict &verdict) {
+			// warm and pre-screened frames were not smoothed
+			char crossings[16] = "-";
+			if (verdict.crossings != KNOT_CROSSINGS_UNKNOWN) {
+				snprintf(crossings, sizeof(crossings), "%u", verdict.crossings);
+			}
+			fprintf(framesFile, "%zu\t%s\t%s\t%u\t%s\t%s\n", verdict.frame,
+					verdict.knotted ? "yes" : "no", crossings, verdict.sweeps,
+					verdict.warm ? "yes" : "no",
+					verdict.prescreened ? "yes" : "no");
+		});
+		profiler.endStructure(nullptr);
+		fclose(framesFile);
+		if (RC) {
+			printf(" ***** ERROR #%i: frame %zu could not be read\n", RC,
+					analyzer.frameCount());
+		}
+		printf("Frames: %zu Warm started: %zu Seconds: %.2f "
+				"Frames per second: %.1f\n", analyzer.frameCount(),
+				analyzer.warmCount(), analyzer.seconds(),
+				analyzer.seconds() > 0.0 ?
+						analyzer.frameCount() / analyzer.seconds() : 0.0);
+		if (profiling) {
+			workerProfilers.mergeInto(profiler);
+			profiler.report();
+		}
+		system("pause");
+		return RC;
+	}
+
+	/* a manifest is screened in shards that share nothing but the
+	 * filesystem, --merge combines their result files afterwards
+	 */
+	std::optional<std::string> manifestPath = CommandLineOptions::manifest(
+			argc, argv);
+	if (manifestPath) {
+		ShardPlan plan;
+		std::string prefix = CommandLineOptions::results(argc, argv).value_or(
+				filesystem::path(*manifestPath).replace_extension().string()
+						+ "-results");
+		std::optional<unsigned int> nMerge = CommandLineOptions::merge(argc,
+				argv);
+		std::pair<unsigned int, unsigned int> shard =
+				CommandLineOptions::shard(argc, argv).value_or(
+						std::make_pair(0u, 1u));
+		if (plan.load(manifestPath->c_str())) {
+			printf(" ***** ERROR: could not read manifest %s\n",
+					manifestPath->c_str());
+			return 1;
+		}
+		if (timeBudget) {
+			printf("Warning: option 'time_budget_ms' is ignored with a manifest\n");
+		}
+		if (nMerge) {
+			return plan.merge(prefix, *nMerge);
+		}
+		plan.assign(shard.second);
+		printf("Shard %u/%u: cost %.0f of %.0f\n", shard.first, shard.second,
+				plan.shardCost(shard.first), [&plan]() {
+					double total = 0.0;
+					for (const ManifestEntry &entry : plan.entries()) {
+						total += entry.cost;
+					}
+					return total;
+				}());
+		RC = plan.run(shard.first, prefix,
+				[](const std::string &path,
+						std::unique_ptr<DoubleMatrix> &matrix) {
+#ifdef PKA_WITH_MMDB
+					int nEntryModels, nEntryChains;
+					CModel **entryModels;
+					CChain **entryChains;
+					std::unique_ptr<CMMDBManager> entryMMDB = std::make_unique<
+							CMMDBManager>();
+					entryMMDB->SetFlag(
+							MMDBF_PrintCIFWarnings | MMDBF_FixSpaceGroup
+									| MMDBF_IgnoreDuplSeqNum | MMDBF_IgnoreHash);
+					int entryRC = entryMMDB->ReadCoorFile(path.c_str());
+					if (entryRC) {
+						printf(" ***** ERROR #%i READ %s: %s\n", entryRC,
+								path.c_str(), GetErrorDescription(entryRC));
+						return entryRC;
+					}
+					// first chain of the first model, as for a single file
+					entryMMDB->GetModelTable(entryModels, nEntryModels);
+					for (int i = 0; i < nEntryModels; i++) {
+						if (entryModels[i]) {
+							entryModels[i]->GetChainTable(entryChains,
+									nEntryChains);
+							if (nEntryChains == 0) {
+								break;
+							}
+							int entryModelId = entryModels[i]->GetSerNum();
+							cpstr entryChainId = entryChains[0]->GetChainID();
+							MMDBAndCarbonAlphaMatrix converter;
+							converter.setMMDBModel(std::move(entryMMDB),
+									entryModelId, entryChainId);
+							matrix = converter.toMatrix();
+							return 0;
+						}
+					}
+					printf(" ***** ERROR READ %s: no chain\n", path.c_str());
+					return -1;
+#else
+					int entryRC = CarbonAlphaReader::read(path.c_str(), matrix);
+					if (entryRC) {
+						printf(" ***** ERROR #%i READ %s\n", entryRC,
+								path.c_str());
+					}
+					return entryRC;
+#endif
+				}, extendTermini, prescreen, profiling ? &profiler : nullptr);
+		printf("Trace buffers allocated: %llu Reused: %llu "
+				"From other threads: %llu\n",
+				(unsigned long long) TraceBufferPool::allocationCount(),
+				(unsigned long long) TraceBufferPool::reuseCount(),
+				(unsigned long long) TraceBufferPool::sharedCount());
+		if (prescreen) {
+			printf("Pre-screen: %llu of %llu chains skipped (%.1f%%)\n",
+					(unsigned long long) KnotPrescreen::skippedCount(),
+					(unsigned long long) KnotPrescreen::screenedCount(),
+					KnotPrescreen::screenedCount() ?
+							100.0 * KnotPrescreen::skippedCount()
+									/ KnotPrescreen::screenedCount() :
+							0.0);
+		}
+		if (profiling) {
+			profiler.report();
+		}
+		if (RC == 1) {
+			printf(" ***** ERROR: could not write %s\n",
+					ShardPlan::resultFileName(prefix, shard.first,
+							shard.second).c_str());
+		}
+		return RC;
+	}
+
+#ifdef PKA_WITH_MMDB
 	MMDB->SetFlag(
 			MMDBF_PrintCIFWarnings | MMDBF_FixSpaceGroup
 					| MMDBF_IgnoreDuplSeqNum | MMDBF_IgnoreHash);
+#endif
 
+	profiler.beginStructure(inputFileStem);
+	profiler.begin(PhaseProfiler::PARSE);
+#ifdef PKA_WITH_MMDB
 	if (inputFileExtension == ".pdb") {
 		std::cout << "Reading PDB file: " << inputFilePath << std::endl;
 		RC = MMDB->ReadPDBASCII(inputFilePath.string().c_str());
@@ -72,6 +386,17 @@ int main(int argc, char **argv) {
 	} else {
 		errorCode = 1;
 	}
+#else
+	if (inputFileExtension == ".pdb" || inputFileExtension == ".ent"
+			|| inputFileExtension == ".cif") {
+		std::cout << "Reading alpha carbons: " << inputFilePath << std::endl;
+		RC = CarbonAlphaReader::read(inputFilePath.string().c_str(),
+				carbonAlphaMatrix);
+	} else {
+		errorCode = 1;
+	}
+#endif
+	profiler.end();
 
 //    4.3 Check for possible errors:
 	if (errorCode) {
@@ -81,16 +406,24 @@ int main(int argc, char **argv) {
 	} else {
 		if (RC) {
 			errorCode = 2;
+#ifdef PKA_WITH_MMDB
 			//  An error was encountered. MMDB provides an error messenger
 			//  function for easy error message printing.
 			printf(" ***** ERROR #%i READ:\n\n %s\n\n", RC,
 					GetErrorDescription(RC));
+#else
+			printf(" ***** ERROR #%i READ: %s\n", RC,
+					RC == 1 ? "could not open the file" :
+					RC == 2 ? "no alpha carbon coordinates" :
+								"unsupported file type");
+#endif
 		}
 	}
 
 	if (!errorCode) {
 		std::cout << "File read successfully: " << inputFilePath << std::endl;
 
+#ifdef PKA_WITH_MMDB
 		int atomTotalNumber = MMDB->GetNumberOfAtoms();
 		int modelTotalNumber = MMDB->GetNumberOfModels();
 
@@ -102,7 +435,7 @@ int main(int argc, char **argv) {
 		 */
 		printf("Selecting First Chain of Model...\n");
 		int modelId = -1;
-		cpstr chainId;
+		cpstr chainId = nullptr;
 		MMDB->GetModelTable(modelTable, nModels);
 		for (im = 0; im < nModels; im++) {
 			if (modelTable[im]) {
@@ -121,15 +454,47 @@ int main(int argc, char **argv) {
 			printf("Setting Converter...\n");
 			converter.setMMDBModel(std::move(MMDB), modelId, chainId);
 			printf("Generating Alpha Carbon Matrix...\n");
+			profiler.begin(PhaseProfiler::EXTRACT);
 			carbonAlphaMatrix = converter.toMatrix();
+		}
+#endif
+
+		if (carbonAlphaMatrix) {
+			// residues of the protein, the extended termini are not counted
+			std::size_t nResidue = carbonAlphaMatrix->s;
+			printf("Residues: %zu\n", nResidue);
+			profiler.setResidues(nResidue);
+			if (extendTermini) {
+				printf("Extending termini beyond the convex hull, the trace "
+						"gets 2 fixed vertexes...\n");
+				profiler.begin(PhaseProfiler::EXTRACT);
+				carbonAlphaMatrix = TaylorKnotAlgorithm::extendTermini(
+						*carbonAlphaMatrix);
+			}
+			if (prescreen) {
+				// every iteration is still written, only the signals are shown
+				PrescreenResult screen = KnotPrescreen::screen(
+						*carbonAlphaMatrix, nResidue);
+				printf("Pre-screen: Residues: %zu Radius of gyration: %.2f "
+						"Crossings: %u Unknotted: %s\n", screen.residues,
+						screen.radiusOfGyration, screen.crossings,
+						screen.unknotted ? "yes" : "no");
+			}
 			//printf("Alpha Carbon Matrix:\n");
 			//carbonAlphaMatrix->printMatrix();
 			//carbonAlphaMatrix->writetoFileMatrix("matrix1.txt");
-			printf("Converting matrix to MMDB Model...\n");
-			MMDBAndCarbonAlphaMatrix converter1;
-			converter1.setMatrix(std::move(carbonAlphaMatrix));
-			MMDBExport = converter1.toMMDB();
-			carbonAlphaMatrix = converter1.getMatrix();
+			/* every smoothing iteration is appended to one multi-model PDB
+			 * without building an MMDB structure for it
+			 */
+			printf("Writing alpha carbon trace...\n");
+			profiler.begin(PhaseProfiler::EXPORT);
+			CarbonAlphaMatrixWriter traceWriter;
+			string traceFileName;
+			traceFileName.append(inputFileStem).append("-trace.pdb");
+			traceWriter.open(traceFileName.c_str(),
+					CarbonAlphaMatrixWriter::PDB, true);
+			traceWriter.writeFrame(*carbonAlphaMatrix);
+#ifdef PKA_WITH_OCCT
 			printf("Converting matrix to OCCT Shape...\n");
 			CarbonAlphaMatrixAndOCCT_Shape shapeConverter;
 			shapeConverter.setMatrix(std::move(carbonAlphaMatrix));
@@ -141,16 +506,24 @@ int main(int argc, char **argv) {
 			string fileName;
 			fileName.append(inputFileStem).append("-0.stp");
 			OCCT_ShapePtr->writeSTEP((char*) fileName.c_str());
-			//RC = MMDBExport->WritePDBASCII("out1.pdb");
-			//RC = MMDBExport->WriteCIFASCII("out1.cif");
-			//RC = MMDBExport->WriteMMDBF("out1.bin");
+#endif
 			printf("Running Taylor Knot Algorithm...\n");
 			TaylorKnotAlgorithm taylorAlgorithm;
-			for (int i = 1; i <= 20; i++) {
-				taylorAlgorithm.setMatrix(std::move(carbonAlphaMatrix));
+			if (timeBudget) {
+				printf("Time budget: %u ms\n", *timeBudget);
+				taylorAlgorithm.setTimeBudget(
+						std::chrono::milliseconds(*timeBudget));
+			}
+			for (int i = 1; i <= 20 && !taylorAlgorithm.isInterrupted(); i++) {
+				// the trace was only written, the smoothing goes on
+				taylorAlgorithm.setMatrix(std::move(carbonAlphaMatrix), i > 1);
 				printf("Running Taylor Knot Algorithm: Smooth #%d\n", i);
+				profiler.begin(PhaseProfiler::SMOOTH);
 				taylorAlgorithm.smooth(50);
+				profiler.begin(PhaseProfiler::EXPORT);
 				carbonAlphaMatrix = taylorAlgorithm.getMatrix();
+				traceWriter.writeFrame(*carbonAlphaMatrix);
+#ifdef PKA_WITH_OCCT
 				printf("Converting matrix to OCCT Shape...\n");
 				shapeConverter.setMatrix(std::move(carbonAlphaMatrix));
 				shapeConverter.toShape();
@@ -161,13 +534,46 @@ int main(int argc, char **argv) {
 				fileName.clear();
 				fileName.append(inputFileStem).append("-").append(to_string(i)).append(".stp");
 				OCCT_ShapePtr->writeSTEP((char*) fileName.c_str());
+#endif
+			}
+			traceWriter.close();
+			/* keep smoothing until no vertex moves, long chains are
+			 * contracted on a coarse copy first
+			 */
+			printf("Running Taylor Knot Algorithm until converged...\n");
+			taylorAlgorithm.setMatrix(std::move(carbonAlphaMatrix), true);
+			profiler.begin(PhaseProfiler::SMOOTH);
+			// same choice as TaylorKnotAlgorithm::detect()
+			if (TaylorKnotAlgorithm::multiResolution(nResidue,
+					extendTermini)) {
+				taylorAlgorithm.smoothMultiResolution();
+			} else {
+				taylorAlgorithm.smoothAuto();
 			}
+			profiler.begin(PhaseProfiler::DETECT);
+			ProvisionalVerdict verdict = taylorAlgorithm.verdict();
+			profiler.end();
+			// the sweeps of the written iterations are counted too
+			printf("Sweeps: %u Converged: %s Crossings: %u\n",
+					taylorAlgorithm.sweepCount(),
+					verdict.converged ? "yes" : "no", verdict.crossings);
+			if (verdict.interrupted) {
+				printf("Time budget expired, vertexes still moving: %u "
+						"Confidence: %.2f\n", verdict.moving, verdict.confidence);
+			}
+			printf("Knot detected: %s%s\n", verdict.knotted ? "yes" : "no",
+					verdict.converged ? "" : " (provisional)");
+			carbonAlphaMatrix = taylorAlgorithm.getMatrix();
 			//printf("Alpha Carbon Matrix:\n");
 			//carbonAlphaMatrix->printMatrix();
 			//carbonAlphaMatrix->writetoFileMatrix("matrix1.txt");
 		}
 
 	}
+	if (profiling) {
+		profiler.endStructure();
+		profiler.report();
+	}
 
 	system("pause");
 	return 0;